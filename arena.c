@@ -0,0 +1,152 @@
+#include "arena.h"
+#include "aarch64.h"
+#include "assert.h"
+#include "buddy_alloc.h"
+#include "errno.h"
+#include "mm.h"
+#include "util.h"
+
+/**
+ * @brief arena of a cpu on its own cache line
+ *
+ */
+typedef struct cpu_arena {
+  arena_t arena;
+  uint8_t padding[CACHE_LINE_SIZE - sizeof(arena_t)];
+} __attribute__((aligned(CACHE_LINE_SIZE))) cpu_arena_t;
+
+/**
+ * @brief per cpu arenas, zeroed so they start empty with single page chunks
+ *
+ */
+static cpu_arena_t cpu_arenas[MAX_CPUS];
+
+/**
+ * @brief give a chunk back to buddy allocator
+ *
+ */
+static void arena_free_chunk(arena_chunk_t *chunk) {
+  page_t *page = get_page_struct(get_page_indx((uint64_t)chunk));
+  free_pages(page, (uint8_t)chunk->order);
+}
+
+/**
+ * @brief take a new chunk big enough for size bytes at align and make it
+ * current, rest of the old chunk is left unused
+ * @return ESUCCESS or EFAILURE if buddy allocator can't give the chunk
+ */
+static uint8_t arena_grow(arena_t *arena, size_t size, size_t align) {
+  uint64_t needed = sizeof(arena_chunk_t) + size + align - 1U;
+  uint8_t order = arena->chunk_order;
+  while ((get_page_size() << order) < needed) {
+    order++;
+    if (order >= MAX_ORDER) {
+      return EFAILURE;
+    }
+  }
+
+  page_t *page = get_free_pages(order);
+  if (page == NULL) {
+    return EFAILURE;
+  }
+  arena_chunk_t *chunk = (arena_chunk_t *)get_page_addr(page);
+  chunk->order = order;
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arena->start = (uint64_t)chunk + sizeof(arena_chunk_t);
+  arena->cur = arena->start;
+  arena->end = (uint64_t)chunk + (get_page_size() << order);
+  return ESUCCESS;
+}
+
+/**
+ * @brief init an empty arena which takes chunks from buddy allocator on
+ * demand
+ */
+void arena_init(arena_t *arena, uint8_t chunk_order) {
+  assert(chunk_order < MAX_ORDER);
+  memset(arena, 0x0, sizeof(arena_t));
+  arena->chunk_order = chunk_order;
+}
+
+/**
+ * @brief init an arena over a fixed memory region, it never grows
+ *
+ */
+void arena_init_fixed(arena_t *arena, void *start, uint64_t size) {
+  memset(arena, 0x0, sizeof(arena_t));
+  arena->start = (uint64_t)start;
+  arena->cur = arena->start;
+  arena->end = arena->start + size;
+  arena->fixed = 1U;
+}
+
+/**
+ * @brief allocate memory from arena
+ * fast path is an align and a bump of cur, a new chunk is taken only when
+ * current one can't fit size
+ */
+void *arena_alloc(arena_t *arena, size_t size, size_t align) {
+  if ((size == 0U) || !_is_power_of_two(align)) {
+    return NULL;
+  }
+  if (align < ARENA_MIN_ALIGN) {
+    align = ARENA_MIN_ALIGN;
+  }
+
+  uint64_t cur = arena->cur;
+  uint64_t addr = _alignto(cur, align);
+  if ((addr + size) > arena->end) {
+    if (arena->fixed || (arena_grow(arena, size, align) != ESUCCESS)) {
+      return NULL;
+    }
+    cur = arena->cur;
+    addr = _alignto(cur, align);
+  }
+  arena->cur = addr + size;
+  return (void *)addr;
+}
+
+/**
+ * @brief give back everything allocated from arena at once
+ * only chunks are walked, objects are never looked at
+ */
+void arena_reset(arena_t *arena) {
+  if (arena->chunks != NULL) {
+    arena_chunk_t *chunk = arena->chunks->next;
+    arena->chunks->next = NULL;
+    while (chunk != NULL) {
+      arena_chunk_t *next = chunk->next;
+      arena_free_chunk(chunk);
+      chunk = next;
+    }
+  }
+  arena->cur = arena->start;
+}
+
+/**
+ * @brief give back every chunk of arena to buddy allocator
+ *
+ */
+void arena_destroy(arena_t *arena) {
+  if (arena->fixed) {
+    /*region is not ours to give back*/
+    arena->cur = arena->start;
+    return;
+  }
+  arena_chunk_t *chunk = arena->chunks;
+  while (chunk != NULL) {
+    arena_chunk_t *next = chunk->next;
+    arena_free_chunk(chunk);
+    chunk = next;
+  }
+  arena_init(arena, arena->chunk_order);
+}
+
+/**
+ * @brief get current cpu arena
+ * mpidr is used so it works before the idle thread of the cpu exists
+ */
+arena_t *arena_this_cpu(void) {
+  return &cpu_arenas[get_mpidr() & MPIDR_AFF0_MASK].arena;
+}
@@ -0,0 +1,88 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include "board.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief every arena allocation is aligned at least to it
+ *
+ */
+#define ARENA_MIN_ALIGN 8UL
+
+/**
+ * @brief header at the start of every chunk an arena takes from buddy
+ * allocator, chunks of an arena are linked newest first
+ */
+typedef struct arena_chunk {
+  struct arena_chunk *next; /*older chunk*/
+  uint64_t order;           /*buddy order of the chunk*/
+} arena_chunk_t;
+
+/**
+ * @brief region allocator, memory is handed out by bumping cur till end and
+ * only given back all at once by arena_reset or arena_destroy
+ * zeroed arena_t is an empty arena growing by single page chunks
+ * arena is not locked, its owner serialises the calls
+ */
+typedef struct arena {
+  uint64_t start;        /*first usable byte of current chunk*/
+  uint64_t cur;          /*next free byte of current chunk*/
+  uint64_t end;          /*end of current chunk*/
+  arena_chunk_t *chunks; /*chunks taken from buddy, current one first*/
+  uint8_t chunk_order;   /*least order of a chunk taken from buddy*/
+  uint8_t fixed;         /*arena is a fixed region, never takes chunks*/
+  uint8_t padding[6];
+} arena_t;
+
+/**
+ * @brief init an empty arena which takes chunks from buddy allocator on
+ * demand
+ * @param arena to init
+ * @param chunk_order least order of a chunk, bigger allocations take a chunk
+ * of their own size
+ */
+void arena_init(arena_t *arena, uint8_t chunk_order);
+
+/**
+ * @brief init an arena over a fixed memory region, it never grows
+ * used to carve structures before buddy allocator exists
+ * @param arena to init
+ * @param start of the region
+ * @param size of the region in bytes
+ */
+void arena_init_fixed(arena_t *arena, void *start, uint64_t size);
+
+/**
+ * @brief allocate memory from arena, it is a pointer bump unless current
+ * chunk is full
+ * memory is not zeroed
+ * @param arena to allocate from
+ * @param size in bytes
+ * @param align power of 2, ARENA_MIN_ALIGN is used if smaller
+ * @return memory or NULL if arena can't grow
+ */
+void *arena_alloc(arena_t *arena, size_t size, size_t align);
+
+/**
+ * @brief give back everything allocated from arena at once
+ * newest chunk is kept for the next round, others go back to buddy allocator
+ */
+void arena_reset(arena_t *arena);
+
+/**
+ * @brief give back every chunk of arena to buddy allocator
+ * arena stays usable as an empty arena, fixed arena is only reset
+ */
+void arena_destroy(arena_t *arena);
+
+/**
+ * @brief get current cpu arena
+ * it is meant for short lived allocations of the code running on the cpu,
+ * which resets it once done, should not be used from irq context
+ * @return arena of current cpu
+ */
+arena_t *arena_this_cpu(void);
+
+#endif
@@ -1,62 +1,310 @@
 #include "buddy_alloc.h"
+#include "aarch64.h"
 #include "assert.h"
 #include "board.h"
+#include "compaction.h"
+#include "errno.h"
 #include "mm.h"
+#include "psw.h"
+#include "shrinker.h"
 #include "util.h"
 
 /*Limitation of buddy allocator is you cannot allocate memory
  * more than 2^(MAX_ORDER-1)*PAGE_SIZE at once*/
-#define ORDER_SIZE(n) (PAGE_SIZE * (1 << n))
+#define ORDER_SIZE(n) (PAGE_SIZE * BIT(n))
 // Bitmap index and position macros
 #define BITMAP_INDEX(block) ((block) / BITS_PER_UINT64)
 #define BIT_POSITION(block) ((block) % BITS_PER_UINT64)
 
+/*memory handed to the freelists by buddy_heap_init, rest of the zone is
+ * handed over later in chunks by deferred_init_memory*/
+#define DEFERRED_INIT_EARLY_SIZE (64UL * 1024UL * 1024UL)
+#define DEFERRED_INIT_CHUNK_SIZE (16UL * ORDER_SIZE(MAX_ORDER - 1))
+
+/**
+ * @brief per cpu page caches in front of the zone freelists
+ * indexed by cpu affinity, only the owner cpu touches its pageset
+ */
+static per_cpu_pageset_t pagesets[MAX_CPUS];
+
+/**
+ * @brief get current cpu pageset
+ * mpidr is used instead of current thread since pages are needed before the
+ * idle thread of the cpu exists
+ */
+static per_cpu_pageset_t *get_local_pageset(void) {
+  return &pagesets[get_mpidr() & MPIDR_AFF0_MASK];
+}
+
+/**
+ * @brief setup default watermarks for every cpu hot/cold lists
+ * cold list is kept shorter since its pages are not expected to be in cache
+ */
+static void pcp_init(void) {
+  for (uint8_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+    for (uint8_t order = 0; order < PCP_MAX_ORDER; order++) {
+      uint32_t batch = PCP_DEFAULT_BATCH >> order;
+      for (uint8_t type = 0; type < PCP_LISTS_COUNT; type++) {
+        per_cpu_pages_t *pcp = &pagesets[cpu].pcp[order][type];
+        pcp->list = NULL;
+        pcp->count = 0;
+        pcp->low = 0;
+        pcp->high = (type == PCP_HOT) ? (6 * batch) : (2 * batch);
+        pcp->batch = batch;
+      }
+    }
+    pagesets[cpu].zero_list = NULL;
+    pagesets[cpu].zero_count = 0;
+  }
+}
+
+/**
+ * @brief bit position of the block pair in zone bitmap
+ * bitmap is split in groups of BITMAP_GROUP_BITS bits, one group per max order
+ * block, inside a group order o pairs start at
+ * (BITMAP_GROUP_BITS - (BITMAP_GROUP_BITS >> o)), so all the orders checked
+ * while merging one block lie in the same two cache lines
+ */
+static uint64_t buddy_bitmap_bit(zone_t *zone, uint64_t index, uint8_t order) {
+  /*page offset from first max order block of the zone*/
+  uint64_t offset = index - zone->bitmap_base_pfn;
+  uint64_t group = offset >> (MAX_ORDER - 1);
+  /*pair index inside the max order block*/
+  uint64_t pair_indx = (offset & (BITMAP_GROUP_BITS - 1U)) >> (order + 1U);
+  return (group * BITMAP_GROUP_BITS) +
+         (BITMAP_GROUP_BITS - (BITMAP_GROUP_BITS >> order)) + pair_indx;
+}
+
 /**
  * @brief when the block is taken from a freearea
  * or given back
  * mark the bitmap by toggling the block pair bit
  *
  */
-static void buddy_toggle_bitmap(uint64_t index, uint8_t order,
-                                FreeArea_t *area) {
-  /*block_index in that order = index of page / (order)
-  pair_indx = block_idx/2
-  bitmap_idx = BITMAP_INDEX(pair_indx)
-  bit_position = BIT_POSITION(pair_indx)*/
-  uint64_t pair_indx = (index / BIT(1 + order));
-  area->bitmap[BITMAP_INDEX(pair_indx)] ^= (1UL << BIT_POSITION(pair_indx));
+static void buddy_toggle_bitmap(zone_t *zone, uint64_t index, uint8_t order) {
+  uint64_t bit = buddy_bitmap_bit(zone, index, order);
+  zone->bitmap[BITMAP_INDEX(bit)] ^= (1UL << BIT_POSITION(bit));
 }
 
 /**
  * @brief get the bitmap for the indez and order
  *
  */
-static uint8_t buddy_get_bitmap(uint64_t index, uint8_t order,
-                                FreeArea_t *area) {
-  /*block_index in that order = index of page / (order)
-  pair_indx = block_idx/2
-  bitmap_idx = BITMAP_INDEX(pair_indx)
-  bit_position = BIT_POSITION(pair_indx)*/
-  uint64_t pair_indx = (index / BIT(1 + order));
-  return (uint8_t)((area->bitmap[BITMAP_INDEX(pair_indx)] &
-                    (1UL << BIT_POSITION(pair_indx))) >>
-                   BIT_POSITION(pair_indx));
+static uint8_t buddy_get_bitmap(zone_t *zone, uint64_t index, uint8_t order) {
+  uint64_t bit = buddy_bitmap_bit(zone, index, order);
+  return (uint8_t)((zone->bitmap[BITMAP_INDEX(bit)] >> BIT_POSITION(bit)) &
+                   1UL);
+}
+
+/**
+ * @brief add a free block at the head of freearea list of its order
+ * and mark the order as available in zone order mask
+ */
+static void freearea_add_block(zone_t *zone, uint8_t order,
+                               FreeBlock_t *block) {
+  FreeArea_t *area = &zone->area[order];
+  /*mark the head page so compaction can walk over free blocks*/
+  page_t *page = get_page_struct(get_page_indx((uint64_t)block));
+  page->order = order;
+  page->pfn = (uint32_t)get_page_indx((uint64_t)block);
+  page->zone_id = zone->zone_id;
+  page->page_owner = OWNER_COUNT;
+  page->flags = PG_BUDDY;
+  block->prev = NULL;
+  block->next = area->freeblocks_list;
+  if (block->next != NULL) {
+    block->next->prev = block;
+  }
+  area->freeblocks_list = block;
+  area->nr_free++;
+  zone->nr_free_pages += BIT(order);
+  zone->free_area_mask |= (uint16_t)UBIT(order);
+}
+
+/**
+ * @brief unlink a free block from anywhere in freearea list of its order
+ * O(1) since the node knows its neighbours, clears the order from zone order
+ * mask when its list gets empty
+ */
+static void freearea_del_block(zone_t *zone, uint8_t order,
+                               FreeBlock_t *block) {
+  FreeArea_t *area = &zone->area[order];
+  if (block->prev != NULL) {
+    block->prev->next = block->next;
+  } else {
+    /*it is at head*/
+    area->freeblocks_list = block->next;
+  }
+  if (block->next != NULL) {
+    block->next->prev = block->prev;
+  }
+  block->next = NULL;
+  block->prev = NULL;
+  area->nr_free--;
+  zone->nr_free_pages -= BIT(order);
+  get_page_struct(get_page_indx((uint64_t)block))->flags = 0U;
+  if (area->freeblocks_list == NULL) {
+    zone->free_area_mask &= (uint16_t)~UBIT(order);
+  }
+}
+
+/**
+ * @brief actual function to free a block of order into zone freelists,
+ * coalesce it with its buddy as long as the buddy is also free
+ * top order blocks are never merged so their bitmap is not used
+ */
+static void buddy_free_block(zone_t *zone, uint64_t address, uint8_t order) {
+  while (order < (MAX_ORDER - 1)) {
+    /*current bitmap value if 1 it means buddy is free else cannot coalesce*/
+    uint8_t bitset = buddy_get_bitmap(zone, get_page_indx(address), order);
+    /*update the bitmap*/
+    buddy_toggle_bitmap(zone, get_page_indx(address), order);
+    if (!bitset) {
+      /*means other buddy is busy allocated so cannot merge then
+      add it to order FreeBlock, further order blocks also cannot be merged*/
+      break;
+    }
+
+    /*that means another block is free we can merge this block with that
+    remove the buddy from freeblock list of current order*/
+    uint64_t buddy_address = address ^ ORDER_SIZE(order);
+    freearea_del_block(zone, order, (FreeBlock_t *)buddy_address);
+
+    /*if second block was free and first was already then start address should
+    be first block address it is necessary because that's how we will be able
+    to find the buddy in next order*/
+    if (address > buddy_address) {
+      address = buddy_address;
+    }
+    order++;
+  }
+
+  freearea_add_block(zone, order, (FreeBlock_t *)address);
+}
+
+/**
+ * @brief free a page aligned memory range into zone freelists
+ * range is split in the largest naturally aligned blocks so the buddy of a
+ * block can always be found by xoring its address
+ */
+static void buddy_free_range(zone_t *zone, uint64_t start, uint64_t end) {
+  while (start < end) {
+    uint8_t order = MAX_ORDER - 1;
+    while ((!_is_align(start, ORDER_SIZE(order))) ||
+           ((start + ORDER_SIZE(order)) > end)) {
+      order--;
+    }
+    buddy_free_block(zone, start, order);
+    start += ORDER_SIZE(order);
+  }
+}
+
+/**
+ * @brief hand one chunk of not yet initialised memory to the freelists
+ * chunk is claimed atomically so many cpus can do it in parallel, chunks are
+ * max order aligned so their blocks never need a buddy from another chunk
+ * @return ESUCCESS if a chunk is handed over, EFAILURE if nothing is left
+ */
+static uint8_t buddy_deferred_init_chunk(void) {
+  for (uint8_t zone_idx = 0; zone_idx < ZONES_COUNT; zone_idx++) {
+    zone_t *zone = get_zone_info(zone_idx);
+    if (!zone->allocatable) { /*it is not for heap*/
+      continue;
+    }
+
+    uint64_t zone_end =
+        _aligntill((zone->start_addr + zone->size), get_page_size());
+    /*cheap check so finished zones don't keep bumping the counter*/
+    if (atomic_load_relaxed(&zone->deferred_next) >= zone_end) {
+      continue;
+    }
+    uint64_t start = atomic_fetch_add_explicit(
+        &zone->deferred_next, DEFERRED_INIT_CHUNK_SIZE, memory_order_relaxed);
+    if (start >= zone_end) {
+      continue; /*someone else took the last one*/
+    }
+    uint64_t end = start + DEFERRED_INIT_CHUNK_SIZE;
+    if (end > zone_end) {
+      end = zone_end;
+    }
+
+    spinlock_acquire(&zone->lock);
+    buddy_free_range(zone, start, end);
+    spinlock_release(&zone->lock);
+    return ESUCCESS;
+  }
+
+  return EFAILURE;
+}
+
+/**
+ * @brief default watermarks of a zone from its size
+ *
+ */
+static void buddy_init_watermarks(zone_t *zone) {
+  uint64_t min = (zone->size / get_page_size()) >> WMARK_MIN_SHIFT;
+  if (min < WMARK_MIN_PAGES) {
+    min = WMARK_MIN_PAGES;
+  }
+  zone->watermark[WMARK_MIN] = min;
+  zone->watermark[WMARK_LOW] = min + (min / 4U);
+  zone->watermark[WMARK_HIGH] = min + (min / 2U);
+}
+
+/**
+ * @brief no of blocks cached in current cpu lists and zero pool
+ *
+ */
+static uint64_t pcp_shrink_count(void) {
+  per_cpu_pageset_t *pageset = get_local_pageset();
+  uint64_t nr_pages = pageset->zero_count;
+  for (uint8_t order = 0; order < PCP_MAX_ORDER; order++) {
+    for (uint8_t type = 0; type < PCP_LISTS_COUNT; type++) {
+      nr_pages += (uint64_t)pageset->pcp[order][type].count << order;
+    }
+  }
+  return nr_pages;
 }
 
+/**
+ * @brief give current cpu cached blocks back to the zones, all of them are
+ * drained since they are only a few pages
+ */
+static uint64_t pcp_shrink_scan(uint64_t nr_pages) {
+  (void)nr_pages;
+  uint64_t cached = pcp_shrink_count();
+  drain_local_pages();
+  return cached;
+}
+
+/**
+ * @brief callbacks are filled at runtime, kernel is position independent and
+ * nothing relocates pointers in static initialisers
+ */
+static shrinker_t pcp_shrinker;
+
 /**
  * @brief init the heap for information about zone memory regions
  * from where to pick the heap and it's size
  *
- * start placing the blocks in highest order if still memory left place then
- * in lower memory order
- * bitmap memory is already carvedout just need to place the blocks in
- * appropriate freelists
+ * whole zone is handed to the free path as naturally aligned blocks, every
+ * bitmap starts as 0 (all allocated) and gets toggled while blocks are freed
+ * and coalesced, this makes sure a block never gets merged with a buddy which
+ * lies outside the zone
  *
  * memory region should be PAGE_SIZE aligned else initialisation will fail with
  * panic
  * @return error code for region addition to heap
  */
 void buddy_heap_init() {
+  /*per cpu lists start empty and get filled on first allocation*/
+  pcp_init();
+  pcp_shrinker.count = pcp_shrink_count;
+  pcp_shrinker.scan = pcp_shrink_scan;
+  if (register_shrinker(&pcp_shrinker) != ESUCCESS) {
+    fatal("pcp shrinker registration failed\n");
+  }
+
   /*loop for all zone and if allocatable then start adding blocks in free list*/
   for (uint8_t zone_idx = 0; zone_idx < ZONES_COUNT; zone_idx++) {
     zone_t *zone = get_zone_info(zone_idx);
@@ -72,36 +320,101 @@ void buddy_heap_init() {
       fatal("zone start addr is not aligned\n");
     }
 
-    uint64_t available_memory_start = zone->start_addr;
-    uint64_t available_memory_size = zone->size;
-    for (uint8_t order = MAX_ORDER - 1; order < UINT8_MAX; order--) {
-      /*get no of blocks possible to fit for current order*/
-      uint64_t nblocks = available_memory_size / (BIT(order) * get_page_size());
-      if (nblocks ==
-          0) /*that means we can't fit a block in freearea for that order*/
-      {
-        continue;
-      }
-      /*if it is possible fill in the blocks in freearea list for that order*/
-      for (uint64_t blk_idx = 0; blk_idx < nblocks; blk_idx++) {
-        FreeBlock_t *current_blk =
-            (FreeBlock_t *)(available_memory_start +
-                            (blk_idx * BIT(order) * get_page_size()));
-        current_blk->next = zone->area[order].freeblocks_list;
-        zone->area[order].freeblocks_list = current_blk;
-      }
-      /*update the available memory*/
-      available_memory_size -= (nblocks * BIT(order) * get_page_size());
-      available_memory_start += (nblocks * BIT(order) * get_page_size());
+    uint64_t zone_end =
+        _aligntill((zone->start_addr + zone->size), get_page_size());
+#if MM_DEFERRED_INIT
+    /*only enough memory for early boot, till a max order boundary so that
+    deferred chunks start aligned, cma zone is small and is needed whole for
+    range allocations*/
+    uint64_t early_end =
+        _alignto((zone->start_addr + DEFERRED_INIT_EARLY_SIZE),
+                 ORDER_SIZE(MAX_ORDER - 1));
+    if ((zone_idx != ZONE_CMA) && (early_end < zone_end)) {
+      zone_end = early_end;
+    }
+#endif
+    buddy_init_watermarks(zone);
+    atomic_store_relaxed(&zone->deferred_next, zone_end);
+    spinlock_acquire(&zone->lock);
+    buddy_free_range(zone, zone->start_addr, zone_end);
+    spinlock_release(&zone->lock);
 
-      printk_debug("buddy_heap_init: order:%d nblocks:%u new_mem_start:%x "
-                   "size_remaining:%x\n",
-                   order, nblocks, available_memory_start,
-                   available_memory_size);
+    for (uint8_t order = 0; order < MAX_ORDER; order++) {
+      printk_debug("buddy_heap_init: order:%d nblocks:%u\n", order,
+                   zone->area[order].nr_free);
     }
   }
 }
 
+/**
+ * @brief take the first free block of order out of zone freelist
+ * and mark the bitmap, top order blocks don't have a pair bit
+ */
+static FreeBlock_t *buddy_take_block(zone_t *zone, uint8_t order) {
+  FreeBlock_t *block = zone->area[order].freeblocks_list;
+  freearea_del_block(zone, order, block);
+  /*this is necessary because it help while merging
+  if bitmap idx is 0 then we can't merge
+  because one of the buddies still may be used
+  if bitmap indx remain 1 while freeing it means other buddy is still in
+  freearea list we can merge*/
+  if (order < (MAX_ORDER - 1)) {
+    buddy_toggle_bitmap(zone, get_page_indx((uint64_t)block), order);
+  }
+  return block;
+}
+
+/**
+ * @brief fill in struct page for starting page of an allocated block
+ *
+ */
+static page_t *buddy_set_page(uint8_t zone_idx, uint64_t address,
+                              uint8_t order) {
+  page_t *page = get_page_struct(get_page_indx(address));
+  page->order = order;
+  page->pfn = (uint32_t)get_page_indx(address);
+  page->zone_id = zone_idx;
+  page->flags = 0U;
+  page->page_owner = OWNER_BUDDY;
+  page->owner_slab = NULL;
+  return page;
+}
+
+/**
+ * @brief zone to try at position pos for an allocation with flags
+ * movable allocations go to cma zone first (it is the last zone) so that
+ * normal zones are kept for everyone else, other allocations never touch cma
+ * zone since it has to be emptied for contiguous ranges
+ * @return NULL if zone at this position can't be used
+ */
+static zone_t *buddy_zone_for(uint8_t pos, uint32_t flags) {
+  uint8_t zone_idx = pos;
+  if (flags & ALLOC_MOVABLE) {
+    zone_idx = (uint8_t)(ZONES_COUNT - 1U - pos);
+  }
+
+  zone_t *zone = get_zone_info(zone_idx);
+  if (!zone->allocatable) { /*it is not for heap*/
+    return NULL;
+  }
+  if ((zone_idx == ZONE_CMA) && !(flags & ALLOC_MOVABLE)) {
+    return NULL;
+  }
+  return zone;
+}
+
+/**
+ * @brief check if zone can give a block of order without going below its min
+ * watermark, should be called with zone lock held
+ */
+static uint8_t zone_watermark_ok(zone_t *zone, uint8_t order,
+                                 uint32_t flags) {
+  if (flags & ALLOC_ATOMIC) {
+    return 1U;
+  }
+  return (zone->nr_free_pages >= (zone->watermark[WMARK_MIN] + BIT(order)));
+}
+
 /**
  * @brief actual function to alloc memory based on order
  * working:
@@ -113,68 +426,128 @@ void buddy_heap_init() {
  * - so next time if same oder allocation is requested then bitmap idx will be 0
  * indicating both blocks not available or free
  * - and remove it from freeblock list
+ * zone lock only covers the freelist and bitmap updates, struct page is
+ * filled after the lock is dropped
+ * zones at their min watermark are skipped unless ALLOC_ATOMIC
+ * block is taken from order >= align_order (align_order >= order) so it is
+ * aligned to it, split always keeps the lower half
+ * @return struct page_t for the allocation, NULL if no zone has a block
+ */
+static page_t *buddy_alloc_zones(uint8_t order, uint8_t align_order,
+                                 uint32_t flags) {
+  for (uint8_t pos = 0; pos < ZONES_COUNT; pos++) {
+    zone_t *zone = buddy_zone_for(pos, flags);
+    if (zone == NULL) {
+      continue;
+    }
+
+    /*first order >= requested which has a free block, zone without a big
+     * enough block gets skipped right here, unlocked read is only a hint*/
+    uint16_t order_mask = (uint16_t)~(UBIT(align_order) - 1U);
+    if ((zone->free_area_mask & order_mask) == 0U) {
+      continue;
+    }
+
+    spinlock_acquire(&zone->lock);
+    uint16_t orders = zone->free_area_mask & order_mask;
+    if ((orders == 0U) || !zone_watermark_ok(zone, order, flags)) {
+      /*someone else took it meanwhile or zone is at its reserve*/
+      spinlock_release(&zone->lock);
+      continue;
+    }
+    uint8_t current_order = (uint8_t)__builtin_ctz(orders);
+
+    /*found one block save it and remove it from free block list*/
+    FreeBlock_t *block = buddy_take_block(zone, current_order);
+
+    /*now need to check if we took block from high order then we need to
+     * split the blocks*/
+    while (current_order > order) {
+      current_order--;
+      /*buddy need to be pushed onto lower order freeblock list*/
+      uint64_t buddy_address = (uint64_t)block ^ ORDER_SIZE(current_order);
+      freearea_add_block(zone, current_order, (FreeBlock_t *)buddy_address);
+      /*also update the bitmap*/
+      buddy_toggle_bitmap(zone, get_page_indx(buddy_address), current_order);
+    }
+    uint8_t low = (zone->nr_free_pages < zone->watermark[WMARK_LOW]);
+    spinlock_release(&zone->lock);
+    if (low) {
+      wakeup_reclaim();
+    }
+
+    /*Now we need to fill in struct page for starting page and return it*/
+    return buddy_set_page(zone->zone_id, (uint64_t)block, order);
+  }
+  return NULL;
+}
+
+/**
+ * @brief alloc a block of order, when zones can't give one:
+ * - pull a chunk of deferred memory and retry
+ * - ALLOC_ATOMIC gives up here since it can't wait
+ * - ask shrinkers for memory once (direct reclaim) and retry
+ * - compact once to build a block of order and retry
+ * block start is aligned to 2^(align_order) pages, alignment bigger than the
+ * block costs a split of a bigger block, not a bigger allocation
  * @return struct page_t for the allocation
  */
-static page_t *buddy_alloc(uint8_t order) {
+static page_t *buddy_alloc_aligned(uint8_t order, uint8_t align_order,
+                                   uint32_t flags) {
+  uint8_t reclaimed = 0U;
+  uint8_t compacted = 0U;
+  page_t *page = NULL;
+
   /*sanity check: if order is greater than MAX_ORDER-1*/
-  if (order >= MAX_ORDER) {
+  if ((order >= MAX_ORDER) || (align_order >= MAX_ORDER)) {
     printk_debug("buddy_alloc: order : %u greater than MAX_ORDER-1: %u", order,
                  MAX_ORDER - 1);
     return NULL;
   }
+  if (align_order < order) {
+    align_order = order;
+  }
 
-  for (uint8_t zone_idx = 0; zone_idx < ZONES_COUNT; zone_idx++) {
-    zone_t *zone = get_zone_info(zone_idx);
-    if (!zone->allocatable) { /*it is not for heap*/
+  while ((page = buddy_alloc_zones(order, align_order, flags)) == NULL) {
+    /*rest of the memory may not be handed over yet, pull a chunk and retry*/
+    if (buddy_deferred_init_chunk() == ESUCCESS) {
       continue;
     }
-
-    for (uint8_t current_order = order; current_order < MAX_ORDER;
-         current_order++) {
-      if (zone->area[current_order].freeblocks_list != NULL) {
-        /*found one block save it and remove it from free block list*/
-        FreeBlock_t *block = zone->area[current_order].freeblocks_list;
-        zone->area[current_order].freeblocks_list = block->next;
-        /*also need to update the bitmap*/
-        /*this is necessary because it help while merging
-        if bitmap idx is 0 then we can't merge
-        because one of the buddies still may be used
-        if bitmap indx remain 1 while freeing it means other buddy is still in
-        freearea list we can merge*/
-        buddy_toggle_bitmap(get_page_indx((uint64_t)block), current_order,
-                            &zone->area[current_order]);
-
-        /*now need to check if we took block from high order then we need to
-         * split the blocks*/
-        while (current_order > order) {
-          current_order--;
-          /*buddy need to be pushed onto lower order freeblock list*/
-          uint64_t buddy_address =
-              (uint64_t)block ^
-              (1UL << (current_order + _get_p2(get_page_size())));
-          FreeBlock_t *buddy = (FreeBlock_t *)buddy_address;
-          buddy->next = zone->area[current_order].freeblocks_list;
-          zone->area[current_order].freeblocks_list = buddy;
-          /*also update the bitmap*/
-          buddy_toggle_bitmap(get_page_indx(buddy_address), current_order,
-                              &zone->area[current_order]);
-        }
-
-        /*Now we need to fill in struct page for starting page and return it*/
-        page_t *page = get_page_struct(get_page_indx((uint64_t)block));
-        page->order = order;
-        page->start_addr = (uint64_t)block;
-        page->zone_id = zone_idx;
-        page->page_owner = OWNER_BUDDY;
-        page->owner_kmem_cache_addr = NULL;
-        return page;
+    if (flags & ALLOC_ATOMIC) {
+      break;
+    }
+    /*caches may be holding free memory*/
+    if (!reclaimed) {
+      reclaimed = 1U;
+      uint64_t wanted =
+          (BIT(align_order) > SHRINK_BATCH) ? BIT(align_order) : SHRINK_BATCH;
+      if (shrink_memory(wanted) != 0U) {
+        continue;
+      }
+    }
+    /*memory may be there but fragmented, try to build a block of order*/
+    if ((align_order > 0U) && !compacted) {
+      compacted = 1U;
+      if (compact_memory(align_order) == ESUCCESS) {
+        continue;
       }
     }
+    break;
   }
 
-  printk_error("Buddy_alloc: No block found!!!\n");
-  return NULL; /*didn't found any free block :(, maybe need to increase
-                  MAX_ORDER for now?*/
+  if (page == NULL) {
+    wakeup_reclaim();
+    printk_error("Buddy_alloc: No block found!!!\n");
+  }
+  return page;
+}
+
+/**
+ * @brief alloc a block of order, see buddy_alloc_aligned
+ *
+ */
+static page_t *buddy_alloc(uint8_t order, uint32_t flags) {
+  return buddy_alloc_aligned(order, order, flags);
 }
 
 /**
@@ -189,87 +562,612 @@ static void buddy_free(page_t *page, uint8_t order) {
   /*assert that page order is matching with order given */
   assert(page->order == order);
 
-  uint64_t address = page->start_addr;         /*page address to free*/
+  uint64_t address = get_page_addr(page);      /*page address to free*/
   zone_t *zone = get_zone_info(page->zone_id); /*zone in which page is present*/
 
   assert((address >= zone->start_addr) &&
          (address < (zone->start_addr + zone->size)));
+
+  // update page info that it is now not own by buddy
+  // this will help prevent free pages not owned by buddy but earlier were owned
+  page->page_owner = OWNER_COUNT;
+
   /*will try add the block into free block or if possible try to coalesce it*/
-  uint8_t current_order = page->order;
-  while (current_order < MAX_ORDER) {
-    /*let check if it's buddy is also available via bitmap*/
-    /*current bitmap value if 1 it means buddy is free else cannot coalesce*/
-    uint8_t bitset = buddy_get_bitmap(get_page_indx(address), current_order,
-                                      &zone->area[current_order]) &
-                     1U;
-    /*update the bitmap*/
-    buddy_toggle_bitmap(get_page_indx(address), current_order,
-                        &zone->area[current_order]);
-    if (bitset) {
-      /*that means another block is free we can merge this block with that*/
-      /*remove the buddy from freeblock list of current order*/
-      FreeBlock_t *current_block = zone->area[current_order].freeblocks_list;
-      FreeBlock_t *prev_block = NULL;
-      uint64_t buddy_address = (uint64_t)address ^ (1 << current_order);
-      FreeBlock_t *buddy = NULL;
-      while (current_block != NULL) {
-        if (current_block == (FreeBlock_t *)buddy_address) {
-          printk_debug("buddy_free: Found it!!\n");
-          /*remove it*/
-          if (prev_block != NULL) {
-            /*that means the block is somewhere in between*/
-            prev_block->next = current_block->next;
-          } else {
-            /*it is at head*/
-            current_block = current_block->next;
-          }
-          /*for reference*/
-          buddy = (FreeBlock_t *)buddy_address;
-          break;
-        }
-        prev_block = current_block;
-        current_block = current_block->next;
+  spinlock_acquire(&zone->lock);
+  buddy_free_block(zone, address, order);
+  spinlock_release(&zone->lock);
+}
+
+/**
+ * @brief actual function to alloc count blocks of order in one pass
+ * working:
+ * - pick the smallest free block which can cover all the remaining blocks,
+ * else the biggest free block available
+ * - carve as many blocks of order as needed from it at once instead of
+ * splitting it one level at a time
+ * - give the unused tail back as naturally aligned blocks, their buddies lie
+ * in the carved part so they never merge back
+ * - struct pages of the carved blocks are filled after zone lock is dropped
+ * @return no of blocks allocated, can be less than count if memory runs out
+ */
+static uint64_t buddy_alloc_bulk(uint8_t order, uint64_t count,
+                                 page_t **out) {
+  uint64_t allocated = 0;
+
+  /*sanity check: if order is greater than MAX_ORDER-1*/
+  if (order >= MAX_ORDER) {
+    printk_debug("buddy_alloc_bulk: order : %u greater than MAX_ORDER-1: %u",
+                 order, MAX_ORDER - 1);
+    return 0;
+  }
+
+  for (uint8_t pos = 0; (pos < ZONES_COUNT) && (allocated < count); pos++) {
+    zone_t *zone = buddy_zone_for(pos, 0U);
+    if (zone == NULL) {
+      continue;
+    }
+
+    while (allocated < count) {
+      spinlock_acquire(&zone->lock);
+      uint16_t orders = zone->free_area_mask & (uint16_t)~(UBIT(order) - 1U);
+      if ((orders == 0U) || !zone_watermark_ok(zone, order, 0U)) {
+        spinlock_release(&zone->lock);
+        break; /*try next zone*/
       }
-      if ((uint64_t)buddy != buddy_address) {
-        /*2 possibities: either bit logic is wrong or
-        race condition need to appropriately setup locks in smp */
-        printk_critical("BUDDY_FREE: This should not happen!!");
+
+      /*order of the block which covers all remaining blocks*/
+      uint64_t remaining = count - allocated;
+      uint8_t wanted_order = order;
+      while ((wanted_order < (MAX_ORDER - 1)) &&
+             (BIT(wanted_order - order) < remaining)) {
+        wanted_order++;
       }
+      uint16_t covering = orders & (uint16_t)~(UBIT(wanted_order) - 1U);
+      uint8_t current_order =
+          (covering != 0U) ? (uint8_t)__builtin_ctz(covering)
+                           : (uint8_t)(31U - __builtin_clz(orders));
 
-      /*if second block was free and first was already then start address should
-      be first block address it is necessary because that's how we will be able
-      to find the buddy in next order*/
-      if (address > buddy_address) {
-        address = buddy_address;
+      uint64_t block = (uint64_t)buddy_take_block(zone, current_order);
+      uint64_t nblocks = BIT(current_order - order);
+      if (nblocks > remaining) {
+        nblocks = remaining;
+      }
+      /*give back the unused tail of the block*/
+      buddy_free_range(zone, block + (nblocks * ORDER_SIZE(order)),
+                       block + ORDER_SIZE(current_order));
+      uint8_t low = (zone->nr_free_pages < zone->watermark[WMARK_LOW]);
+      spinlock_release(&zone->lock);
+      if (low) {
+        wakeup_reclaim();
+      }
+
+      for (uint64_t idx = 0; idx < nblocks; idx++) {
+        out[allocated++] = buddy_set_page(
+            zone->zone_id, block + (idx * ORDER_SIZE(order)), order);
       }
-    } else {
-      /*means other buddy is busy allocated so cannot merge then
-      add it to order FreeBlock */
-      FreeBlock_t *buddy_block = (FreeBlock_t *)address;
-      buddy_block->next = zone->area[current_order].freeblocks_list;
-      zone->area[current_order].freeblocks_list = buddy_block;
-      return; /*further order blocks also cannot be merged*/
     }
-    current_order++;
   }
 
-  // update page info that it is now not own by buddy
-  // this will help prevent free pages not owned by buddy but earlier were owned
+  /*rest of the memory may not be handed over yet, pull a chunk and retry*/
+  if ((allocated < count) && (buddy_deferred_init_chunk() == ESUCCESS)) {
+    return allocated +
+           buddy_alloc_bulk(order, count - allocated, out + allocated);
+  }
+
+  if (allocated < count) {
+    printk_error("Buddy_alloc_bulk: No block found!!!\n");
+  }
+  return allocated;
+}
+
+/**
+ * @brief actual function to free count blocks of order in one pass
+ * zone lock is taken once for every run of blocks from the same zone
+ */
+static void buddy_free_bulk(page_t **pages, uint64_t count, uint8_t order) {
+  zone_t *locked_zone = NULL;
+
+  for (uint64_t idx = 0; idx < count; idx++) {
+    page_t *page = pages[idx];
+    if (!page) {
+      continue;
+    }
+    /*assert that page order is matching with order given */
+    assert(page->order == order);
+    page->page_owner = OWNER_COUNT;
+
+    zone_t *zone = get_zone_info(page->zone_id);
+    if (zone != locked_zone) {
+      if (locked_zone != NULL) {
+        spinlock_release(&locked_zone->lock);
+      }
+      spinlock_acquire(&zone->lock);
+      locked_zone = zone;
+    }
+    buddy_free_block(zone, get_page_addr(page), order);
+  }
+
+  if (locked_zone != NULL) {
+    spinlock_release(&locked_zone->lock);
+  }
+}
+
+/**
+ * @brief hand the memory left by buddy_heap_init to the freelists
+ * called by every secondary cpu during boot, they share the work chunk by
+ * chunk
+ */
+void deferred_init_memory(void) {
+  while (buddy_deferred_init_chunk() == ESUCCESS) {
+  }
+}
+
+/**
+ * @brief take a free block out of the zone freelists and hold it for
+ * compaction
+ * @param page head page of the free block
+ * @return order of the isolated block, MAX_ORDER if page is not the head of a
+ * free block anymore
+ */
+uint8_t buddy_isolate_free_block(page_t *page) {
+  zone_t *zone = get_zone_info(page->zone_id);
+  uint8_t order = MAX_ORDER;
+
+  spinlock_acquire(&zone->lock);
+  if (page->flags & PG_BUDDY) {
+    order = page->order;
+    FreeBlock_t *block = (FreeBlock_t *)get_page_addr(page);
+    freearea_del_block(zone, order, block);
+    /*isolated block counts as allocated for its buddy*/
+    if (order < (MAX_ORDER - 1)) {
+      buddy_toggle_bitmap(zone, page->pfn, order);
+    }
+    page->flags = PG_ISOLATED;
+  }
+  spinlock_release(&zone->lock);
+  return order;
+}
+
+/**
+ * @brief give a block held by compaction back to the zone freelists
+ * @param page head page of the block, order should be valid
+ */
+void buddy_putback_block(page_t *page) {
+  zone_t *zone = get_zone_info(page->zone_id);
+
+  page->flags = 0U;
+  page->page_owner = OWNER_COUNT;
+  spinlock_acquire(&zone->lock);
+  buddy_free_block(zone, get_page_addr(page), page->order);
+  spinlock_release(&zone->lock);
+}
+
+/**
+ * @brief give a whole max order block held by compaction back to the zone
+ * freelists in one go
+ * @param zone which has the block
+ * @param address start of the max order block
+ */
+void buddy_putback_pageblock(zone_t *zone, uint64_t address) {
+  spinlock_acquire(&zone->lock);
+  buddy_free_range(zone, address, address + ORDER_SIZE(MAX_ORDER - 1));
+  spinlock_release(&zone->lock);
+}
+
+/**
+ * @brief grow an allocated block in place by taking its free upper buddies
+ * block can only grow if it is aligned to the new order and every buddy from
+ * its order till the new order is free, nothing is taken otherwise
+ * @param page head page of the allocated block
+ * @param order new order of the block
+ * @return ESUCCESS if the block now has the new order, EFAILURE otherwise
+ */
+uint8_t buddy_extend_block(page_t *page, uint8_t order) {
+  uint64_t address = get_page_addr(page);
+  if ((order >= MAX_ORDER) || (order <= page->order) ||
+      !_is_align(address, ORDER_SIZE(order))) {
+    return EFAILURE;
+  }
+
+  zone_t *zone = get_zone_info(page->zone_id);
+  uint8_t ret = EFAILURE;
+  spinlock_acquire(&zone->lock);
+  if (!zone_watermark_ok(zone, order, 0U)) {
+    goto out;
+  }
+  /*block is aligned to the new order so all its buddies lie above it*/
+  for (uint8_t o = page->order; o < order; o++) {
+    page_t *buddy = get_page_struct(get_page_indx(address + ORDER_SIZE(o)));
+    if ((buddy == NULL) || !(buddy->flags & PG_BUDDY) ||
+        (buddy->order != o) || (buddy->zone_id != page->zone_id)) {
+      goto out;
+    }
+  }
+  for (uint8_t o = page->order; o < order; o++) {
+    freearea_del_block(zone, o, (FreeBlock_t *)(address + ORDER_SIZE(o)));
+    /*both halves are allocated now, same as splitting a bigger block*/
+    buddy_toggle_bitmap(zone, get_page_indx(address), o);
+  }
+  page->order = order;
+  ret = ESUCCESS;
+out:
+  spinlock_release(&zone->lock);
+  return ret;
+}
+
+/**
+ * @brief refill the per cpu list with a batch of blocks from buddy allocator
+ * blocks are taken in bulk so the zone freelists are walked once per chunk,
+ * this is done outside the irq disabled section since releasing zone lock
+ * enables the irq again, only the list push is done with irq disabled
+ */
+static void pcp_refill(per_cpu_pages_t *pcp, uint8_t order) {
+  page_t *pages[PCP_DEFAULT_BATCH];
+  uint32_t remaining = pcp->batch;
+  psw_t psw;
+
+  while (remaining > 0) {
+    uint32_t nr = (remaining < PCP_DEFAULT_BATCH) ? remaining
+                                                   : PCP_DEFAULT_BATCH;
+    uint64_t got = buddy_alloc_bulk(order, nr, pages);
+    psw_disable_and_save_interrupt(&psw);
+    for (uint64_t idx = 0; idx < got; idx++) {
+      FreeBlock_t *block = (FreeBlock_t *)get_page_addr(pages[idx]);
+      block->next = pcp->list;
+      pcp->list = block;
+      pcp->count++;
+    }
+    psw_restore_interrupt(&psw);
+    if (got < nr) {
+      break; /*whatever we got is good enough*/
+    }
+    remaining -= nr;
+  }
+}
+
+/**
+ * @brief give back nr blocks from the per cpu list to the buddy allocator
+ * blocks are popped with irq disabled and freed in bulk chunks outside it
+ */
+static void pcp_drain(per_cpu_pages_t *pcp, uint8_t order, uint32_t nr) {
+  page_t *pages[PCP_DEFAULT_BATCH];
+  psw_t psw;
+
+  while (nr > 0) {
+    uint32_t got = 0;
+    psw_disable_and_save_interrupt(&psw);
+    while ((got < PCP_DEFAULT_BATCH) && (nr > 0) && (pcp->list != NULL)) {
+      FreeBlock_t *block = pcp->list;
+      pcp->list = block->next;
+      pcp->count--;
+      nr--;
+      /*page struct still has the order and zone from the time it was
+       * allocated from buddy*/
+      pages[got++] = get_page_struct(get_page_indx((uint64_t)block));
+    }
+    psw_restore_interrupt(&psw);
+
+    if (got == 0) {
+      break; /*list is empty*/
+    }
+    buddy_free_bulk(pages, got, order);
+  }
+}
+
+/**
+ * @brief alloc a block from current cpu list, refill the list in batch from
+ * buddy allocator when it drops to low watermark
+ * only cpu local memory is touched and no lock is taken unless a refill is
+ * needed, if refill gets nothing buddy_alloc is tried with flags so it can
+ * reclaim or compact
+ */
+static page_t *pcp_alloc(uint8_t order, pcp_list_enum_t type,
+                         uint32_t flags) {
+  psw_t psw;
+
+  /*irq disabled since an isr on this cpu can also alloc from these lists*/
+  psw_disable_and_save_interrupt(&psw);
+  per_cpu_pages_t *pcp = &get_local_pageset()->pcp[order][type];
+  if (pcp->count <= pcp->low) {
+    psw_restore_interrupt(&psw);
+    pcp_refill(pcp, order);
+    psw_disable_and_save_interrupt(&psw);
+  }
+  FreeBlock_t *block = pcp->list;
+  if (block != NULL) {
+    pcp->list = block->next;
+    pcp->count--;
+  }
+  psw_restore_interrupt(&psw);
+
+  if (block == NULL) {
+    return buddy_alloc(order, flags); /*zones are at their reserve*/
+  }
+
+  /*pfn and zone_id are still valid from the refill*/
+  page_t *page = get_page_struct(get_page_indx((uint64_t)block));
+  page->order = order;
+  page->page_owner = OWNER_BUDDY;
+  page->owner_slab = NULL;
+  return page;
+}
+
+/**
+ * @brief free a block into current cpu list, drain the list in batch to
+ * buddy allocator when it goes above high watermark
+ */
+static void pcp_free(page_t *page, uint8_t order, pcp_list_enum_t type) {
+  psw_t psw;
+
+  /*check if page is NULL*/
+  if (!page)
+    return;
+
+  /*cma pages never go to per cpu lists, those serve unmovable allocations*/
+  if (page->zone_id == ZONE_CMA) {
+    buddy_free(page, order);
+    return;
+  }
+
+  /*assert that page order is matching with order given */
+  assert(page->order == order);
+  /*cached block is not owned by anyone, helps to catch double kfree*/
   page->page_owner = OWNER_COUNT;
+  FreeBlock_t *block = (FreeBlock_t *)get_page_addr(page);
+
+  psw_disable_and_save_interrupt(&psw);
+  per_cpu_pages_t *pcp = &get_local_pageset()->pcp[order][type];
+  block->next = pcp->list;
+  pcp->list = block;
+  pcp->count++;
+  uint8_t drain = (pcp->count > pcp->high);
+  psw_restore_interrupt(&psw);
+
+  if (drain) {
+    pcp_drain(pcp, order, pcp->batch);
+  }
+}
+
+/**
+ * @brief tune the watermarks of per cpu list of an order for all cpus
+ * @param order of the list, should be less than PCP_MAX_ORDER
+ * @param type hot or cold list
+ * @param low refill the list in batch when count drops to it
+ * @param high drain the list in batch when count goes above it
+ * @param batch no of blocks moved from/to buddy in one go
+ * @return ESUCCESS on success, EINVALID for invalid watermarks
+ */
+uint8_t pcp_set_watermarks(uint8_t order, pcp_list_enum_t type, uint32_t low,
+                           uint32_t high, uint32_t batch) {
+  if ((order >= PCP_MAX_ORDER) || (type >= PCP_LISTS_COUNT) || (batch == 0) ||
+      (low >= high) || (batch > high)) {
+    return EINVALID;
+  }
+
+  /*lists above the new high watermark get trimmed on their next free*/
+  for (uint8_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+    per_cpu_pages_t *pcp = &pagesets[cpu].pcp[order][type];
+    pcp->low = low;
+    pcp->high = high;
+    pcp->batch = batch;
+  }
+  return ESUCCESS;
+}
+
+/**
+ * @brief take a pre zeroed page from current cpu zero pool
+ * @return page struct pointer, NULL if pool is empty
+ */
+static page_t *zero_pool_alloc(void) {
+  psw_t psw;
+
+  psw_disable_and_save_interrupt(&psw);
+  per_cpu_pageset_t *pageset = get_local_pageset();
+  page_t *page = pageset->zero_list;
+  if (page != NULL) {
+    pageset->zero_list = page->next;
+    pageset->zero_count--;
+  }
+  psw_restore_interrupt(&psw);
+
+  if (page != NULL) {
+    page->page_owner = OWNER_BUDDY;
+    page->owner_slab = NULL;
+  }
+  return page;
+}
+
+/**
+ * @brief check if any zone serving unmovable allocations is below its low
+ * watermark, free page counters are read without lock so it is only a hint
+ */
+static uint8_t buddy_low_on_memory(void) {
+  for (uint8_t pos = 0; pos < ZONES_COUNT; pos++) {
+    zone_t *zone = buddy_zone_for(pos, 0U);
+    if ((zone != NULL) &&
+        (zone->nr_free_pages < zone->watermark[WMARK_LOW])) {
+      return 1U;
+    }
+  }
+  return 0U;
+}
+
+/**
+ * @brief no of pages zones which shrinkers can help are short of their high
+ * watermark, cma zone is left out since nothing can be shrunk into it
+ */
+uint64_t buddy_reclaim_deficit(void) {
+  uint64_t wanted = 0;
+  for (uint8_t pos = 0; pos < ZONES_COUNT; pos++) {
+    zone_t *zone = buddy_zone_for(pos, 0U);
+    if (zone == NULL) {
+      continue;
+    }
+    uint64_t nr_free = zone->nr_free_pages;
+    if (nr_free < zone->watermark[WMARK_HIGH]) {
+      wanted += zone->watermark[WMARK_HIGH] - nr_free;
+    }
+  }
+  return wanted;
+}
+
+/**
+ * @brief clear pages into current cpu zero pool
+ * pages are linked through page struct so their memory stays all zero,
+ * cold pages are used since clearing doesn't need them in cache, nothing is
+ * pooled while memory is low
+ */
+void zero_pool_refill(void) {
+  per_cpu_pageset_t *pageset = get_local_pageset();
+  psw_t psw;
+
+  if (buddy_low_on_memory()) {
+    return;
+  }
+
+  for (uint32_t idx = 0; (idx < ZERO_POOL_BATCH) &&
+                         (pageset->zero_count < ZERO_POOL_HIGH);
+       idx++) {
+    page_t *page = pcp_alloc(0, PCP_COLD, 0U);
+    if (page == NULL) {
+      return;
+    }
+    clear_page((void *)get_page_addr(page));
+
+    /*pooled page is not owned by anyone like pcp pages*/
+    page->page_owner = OWNER_COUNT;
+    psw_disable_and_save_interrupt(&psw);
+    page->next = pageset->zero_list;
+    pageset->zero_list = page;
+    pageset->zero_count++;
+    psw_restore_interrupt(&psw);
+  }
+}
+
+/**
+ * @brief tune the free page watermarks of a zone
+ * @return ESUCCESS on success, EINVALID for invalid zone or watermarks
+ */
+uint8_t buddy_set_watermarks(uint8_t zone_idx, uint64_t min, uint64_t low,
+                             uint64_t high) {
+  if ((zone_idx >= ZONES_COUNT) || (min > low) || (low > high)) {
+    return EINVALID;
+  }
+
+  zone_t *zone = get_zone_info(zone_idx);
+  spinlock_acquire(&zone->lock);
+  zone->watermark[WMARK_MIN] = min;
+  zone->watermark[WMARK_LOW] = low;
+  zone->watermark[WMARK_HIGH] = high;
+  spinlock_release(&zone->lock);
+  return ESUCCESS;
+}
+
+/**
+ * @brief give back all the blocks cached in current cpu lists and zero pool
+ * to the buddy allocator
+ */
+void drain_local_pages(void) {
+  per_cpu_pageset_t *pageset = get_local_pageset();
+  page_t *page = NULL;
+
+  while ((page = zero_pool_alloc()) != NULL) {
+    buddy_free(page, 0);
+  }
+  for (uint8_t order = 0; order < PCP_MAX_ORDER; order++) {
+    for (uint8_t type = 0; type < PCP_LISTS_COUNT; type++) {
+      pcp_drain(&pageset->pcp[order][type], order, UINT32_MAX);
+    }
+  }
 }
 
 /**
  * @brief get a free page
  * @return page struct pointer
  */
-page_t *get_free_page(void) { return buddy_alloc(0); }
+page_t *get_free_page(void) { return pcp_alloc(0, PCP_HOT, 0U); }
+
+/**
+ * @brief get a free page which is not expected to be touched by cpu soon
+ * served from the per cpu cold list
+ * @return page struct pointer
+ */
+page_t *get_free_page_cold(void) { return pcp_alloc(0, PCP_COLD, 0U); }
 
 /**
  * @brief get free pages, count  = 2^(order)
  * make sure order is less than (max order -1)
+ * small orders are served from per cpu lists
+ * @return page struct pointer
+ */
+page_t *get_free_pages(uint8_t order) {
+  if (order < PCP_MAX_ORDER) {
+    return pcp_alloc(order, PCP_HOT, 0U);
+  }
+  return buddy_alloc(order, 0U);
+}
+
+/**
+ * @brief clear all pages of a block of order
+ *
+ */
+static void clear_block(page_t *page, uint8_t order) {
+  uint64_t address = get_page_addr(page);
+  for (uint64_t idx = 0; idx < BIT(order); idx++) {
+    clear_page((void *)(address + (idx * PAGE_SIZE)));
+  }
+}
+
+/**
+ * @brief get free pages, count = 2^(order), with allocation flags
+ * ALLOC_MOVABLE blocks can be served from cma zone, owner must mark them with
+ * page_set_movable() so they can be moved out when a range is needed
+ * ALLOC_ZERO order 0 blocks come from zero pool when it has a page
+ * @return page struct pointer
+ */
+page_t *alloc_pages(uint8_t order, uint32_t flags) {
+  page_t *page = NULL;
+
+  if ((flags & ALLOC_ZERO) && (order == 0U)) {
+    page = zero_pool_alloc();
+    if (page != NULL) {
+      return page;
+    }
+  }
+
+  if (!(flags & ALLOC_MOVABLE) && (order < PCP_MAX_ORDER)) {
+    page = pcp_alloc(order, PCP_HOT, flags);
+  } else {
+    page = buddy_alloc(order, flags);
+  }
+
+  /*pool is empty or block is bigger, clear it here*/
+  if ((page != NULL) && (flags & ALLOC_ZERO)) {
+    clear_block(page, order);
+  }
+  return page;
+}
+
+/**
+ * @brief get free pages, count = 2^(order), starting at a multiple of
+ * 2^(align_order) pages
+ * block is carved from a free block of align_order and the pages after it go
+ * back to the freelists, so it is freed as a normal block of order
  * @return page struct pointer
  */
-page_t *get_free_pages(uint8_t order) { return buddy_alloc(order); }
+page_t *alloc_pages_aligned(uint8_t order, uint8_t align_order,
+                            uint32_t flags) {
+  /*every block is aligned to its own size*/
+  if (align_order <= order) {
+    return alloc_pages(order, flags);
+  }
+
+  page_t *page = buddy_alloc_aligned(order, align_order, flags);
+  if ((page != NULL) && (flags & ALLOC_ZERO)) {
+    clear_block(page, order);
+  }
+  return page;
+}
 
 /**
  * @brief free the page based on order
@@ -277,11 +1175,47 @@ page_t *get_free_pages(uint8_t order) { return buddy_alloc(order); }
  * order is assumed to be zero
  * @param page struct pointer
  */
-void free_page(page_t *page) { return buddy_free(page, 0); }
+void free_page(page_t *page) { return pcp_free(page, 0, PCP_HOT); }
+
+/**
+ * @brief free a page which is not expected to be touched by cpu soon
+ * page is added to per cpu cold list so hot pages are not pushed out
+ * @param page struct pointer
+ */
+void free_page_cold(page_t *page) { return pcp_free(page, 0, PCP_COLD); }
 
 /**
  * @brief free the page based on order
  * TODO: should we also check if page lies in page_struct region?
+ * small orders are given back to per cpu lists
  * @param order of the page
  */
-void free_pages(page_t *page, uint8_t order) { return buddy_free(page, order); }
+void free_pages(page_t *page, uint8_t order) {
+  if (order < PCP_MAX_ORDER) {
+    return pcp_free(page, order, PCP_HOT);
+  }
+  return buddy_free(page, order);
+}
+
+/**
+ * @brief allocate count blocks of 2^(order) pages in one pass over the zone
+ * freelists, a big free block is carved into many small ones at once
+ * @param order of every block
+ * @param count no of blocks wanted
+ * @param out array to fill with page struct pointers
+ * @return no of blocks allocated, can be less than count if memory runs out
+ */
+uint64_t get_free_pages_bulk(uint8_t order, uint64_t count, page_t **out) {
+  return buddy_alloc_bulk(order, count, out);
+}
+
+/**
+ * @brief free count blocks of 2^(order) pages in one pass
+ * NULL entries are skipped
+ * @param pages array of page struct pointers
+ * @param count no of entries in pages
+ * @param order of every block
+ */
+void free_pages_bulk(page_t **pages, uint64_t count, uint8_t order) {
+  return buddy_free_bulk(pages, count, order);
+}
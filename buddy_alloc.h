@@ -1,24 +1,105 @@
 #ifndef __BUDDY_ALLOC_H__
 #define __BUDDY_ALLOC_H__
 
+#include "board.h"
 #include "mm.h"
 #include <stddef.h>
 #include <stdint.h>
 
+/**
+ * @brief orders [0, PCP_MAX_ORDER) are served from per cpu page caches
+ * bigger orders always go to the zone freelists
+ */
+#define PCP_MAX_ORDER 4
+
+/**
+ * @brief default no of blocks moved between the per cpu cache and the buddy
+ * allocator in one go for order 0, it is halved for every next order
+ */
+#define PCP_DEFAULT_BATCH 16U
+
+/**
+ * @brief no of pre zeroed pages kept per cpu, idle cpu clears at most
+ * ZERO_POOL_BATCH pages in one go so it can get back to other work
+ */
+#define ZERO_POOL_HIGH 64U
+#define ZERO_POOL_BATCH 8U
+
+/**
+ * @brief allocation flags for alloc_pages
+ * ALLOC_MOVABLE: block can be migrated by its owner (see compaction.h), it
+ * may be served from cma zone
+ * ALLOC_ZERO: block is returned zeroed, order 0 is served from the per cpu
+ * pool of pages cleared by idle cpu
+ * ALLOC_ATOMIC: caller can't wait for reclaim or compaction (ex: isr), it may
+ * take pages below the min watermark
+ */
+#define ALLOC_MOVABLE (1U << 0)
+#define ALLOC_ZERO (1U << 1)
+#define ALLOC_ATOMIC (1U << 2)
+
+/**
+ * @brief default min watermark is zone pages >> WMARK_MIN_SHIFT but never
+ * below WMARK_MIN_PAGES, low and high are 5/4 and 3/2 of min
+ */
+#define WMARK_MIN_SHIFT 10U
+#define WMARK_MIN_PAGES 32U
+
+/**
+ * @brief per cpu cache list types
+ * hot list holds recently freed pages which are likely still in cpu cache
+ * cold list holds pages which are not expected to be touched soon (ex: dma)
+ */
+typedef enum { PCP_HOT = 0, PCP_COLD, PCP_LISTS_COUNT } pcp_list_enum_t;
+
+/**
+ * @brief per cpu list of free blocks of one order
+ * list is refilled from buddy_alloc in batch when count drops to low and
+ * drained to buddy_free in batch when count goes above high
+ */
+typedef struct per_cpu_pages {
+  FreeBlock_t *list; /*LIFO list of cached free blocks*/
+  uint32_t count;    /*no of blocks in the list*/
+  uint32_t low;      /*refill the list when count drops to low watermark*/
+  uint32_t high;     /*drain the list when count goes above high watermark*/
+  uint32_t batch;    /*no of blocks to move from/to buddy in one go*/
+} per_cpu_pages_t;
+
+/**
+ * @brief per cpu set of hot/cold lists for every cached order
+ * cache line aligned so that no two cpus share a line
+ */
+typedef struct per_cpu_pageset {
+  per_cpu_pages_t pcp[PCP_MAX_ORDER][PCP_LISTS_COUNT];
+  page_t *zero_list;   /*pre zeroed pages linked by page->next*/
+  uint32_t zero_count; /*no of pages in zero_list*/
+  uint8_t padding[CACHE_LINE_SIZE - sizeof(page_t *) - sizeof(uint32_t)];
+} __attribute__((aligned(CACHE_LINE_SIZE))) per_cpu_pageset_t;
+
 /**
  * @brief init the heap for information about zone memory regions
  * from where to pick the heap and it's size
  *
- * start placing the blocks in highest order if still memory left place then
- * in lower memory order
+ * zone memory is freed as largest naturally aligned blocks, coalescing them
+ * through the same bitmaps used while freeing
  * bitmap memory is already carvedout just need to place the blocks in
  * appropriate freelists
  *
+ * with MM_DEFERRED_INIT only first DEFERRED_INIT_EARLY_SIZE of every zone is
+ * freed here, rest is handed over by deferred_init_memory or on demand when an
+ * allocation fails
+ *
  * memory region should be PAGE_SIZE aligned else initialisation will fail with
  * panic
  */
 void buddy_heap_init(void);
 
+/**
+ * @brief hand the memory left by buddy_heap_init to the freelists in chunks
+ * safe to call from many cpus at once, returns when nothing is left
+ */
+void deferred_init_memory(void);
+
 /**
  * @brief get a free page
  * @return page struct pointer
@@ -32,6 +113,36 @@ page_t *get_free_page(void);
  */
 page_t *get_free_pages(uint8_t order);
 
+/**
+ * @brief get free pages, count = 2^(order), with allocation flags
+ * ALLOC_MOVABLE blocks can be served from cma zone, owner must mark them with
+ * page_set_movable() so they can be moved out when a range is needed
+ * ALLOC_ZERO blocks are zeroed, from zero pool if it has a page
+ * @param order of the block
+ * @param flags ALLOC_* flags
+ * @return page struct pointer
+ */
+page_t *alloc_pages(uint8_t order, uint32_t flags);
+
+/**
+ * @brief get free pages, count = 2^(order), aligned to 2^(align_order) pages
+ * a bigger free block is split so alignment doesn't make the block bigger,
+ * block is freed with free_pages(page, order) like any other
+ * @param order of the block
+ * @param align_order alignment of the block start in pages as power of 2,
+ * should be less than MAX_ORDER
+ * @param flags ALLOC_* flags
+ * @return page struct pointer, NULL if no aligned block is there
+ */
+page_t *alloc_pages_aligned(uint8_t order, uint8_t align_order,
+                            uint32_t flags);
+
+/**
+ * @brief clear pages into current cpu zero pool till it has ZERO_POOL_HIGH
+ * pages, called from idle loop so clearing is off the allocation path
+ */
+void zero_pool_refill(void);
+
 /**
  * @brief free the page based on order
  * TODO: will use some struct to have this information of order
@@ -48,4 +159,105 @@ void free_page(page_t *page);
  */
 void free_pages(page_t *page, uint8_t order);
 
+/**
+ * @brief allocate count blocks of 2^(order) pages in one pass over the zone
+ * freelists, a big free block is carved into many small ones at once
+ * @param order of every block
+ * @param count no of blocks wanted
+ * @param out array to fill with page struct pointers
+ * @return no of blocks allocated, can be less than count if memory runs out
+ */
+uint64_t get_free_pages_bulk(uint8_t order, uint64_t count, page_t **out);
+
+/**
+ * @brief free count blocks of 2^(order) pages in one pass
+ * NULL entries are skipped
+ * @param pages array of page struct pointers
+ * @param count no of entries in pages
+ * @param order of every block
+ */
+void free_pages_bulk(page_t **pages, uint64_t count, uint8_t order);
+
+/**
+ * @brief get a free page which is not expected to be touched by cpu soon
+ * served from the per cpu cold list
+ * @return page struct pointer
+ */
+page_t *get_free_page_cold(void);
+
+/**
+ * @brief free a page which is not expected to be touched by cpu soon
+ * page is added to per cpu cold list so hot pages are not pushed out
+ * @param page struct pointer
+ */
+void free_page_cold(page_t *page);
+
+/**
+ * @brief tune the watermarks of per cpu list of an order for all cpus
+ * @param order of the list, should be less than PCP_MAX_ORDER
+ * @param type hot or cold list
+ * @param low refill the list in batch when count drops to it
+ * @param high drain the list in batch when count goes above it
+ * @param batch no of blocks moved from/to buddy in one go
+ * @return ESUCCESS on success, EINVALID for invalid watermarks
+ */
+uint8_t pcp_set_watermarks(uint8_t order, pcp_list_enum_t type, uint32_t low,
+                           uint32_t high, uint32_t batch);
+
+/**
+ * @brief tune the free page watermarks of a zone
+ * @param zone_idx one of zone_enum_t
+ * @param min only ALLOC_ATOMIC allocations go below it
+ * @param low background reclaim is asked for below it
+ * @param high background reclaim stops above it
+ * @return ESUCCESS on success, EINVALID for invalid zone or watermarks
+ */
+uint8_t buddy_set_watermarks(uint8_t zone_idx, uint64_t min, uint64_t low,
+                             uint64_t high);
+
+/**
+ * @brief no of pages the zones are short of their high watermark, only zones
+ * served to normal allocations are counted, free page counters are read
+ * without zone lock so it is only a hint
+ */
+uint64_t buddy_reclaim_deficit(void);
+
+/**
+ * @brief give back all the blocks cached in current cpu lists and zero pool
+ * to the buddy allocator
+ */
+void drain_local_pages(void);
+
+/**
+ * @brief take a free block out of the zone freelists and hold it for
+ * compaction
+ * @param page head page of the free block
+ * @return order of the isolated block, MAX_ORDER if page is not the head of a
+ * free block anymore
+ */
+uint8_t buddy_isolate_free_block(page_t *page);
+
+/**
+ * @brief give a block held by compaction back to the zone freelists
+ * @param page head page of the block, order should be valid
+ */
+void buddy_putback_block(page_t *page);
+
+/**
+ * @brief give a whole max order block held by compaction back to the zone
+ * freelists in one go, every block inside it should be held by the caller
+ * @param zone which has the block
+ * @param address start of the max order block
+ */
+void buddy_putback_pageblock(zone_t *zone, uint64_t address);
+
+/**
+ * @brief grow an allocated block in place by taking its free upper buddies
+ * used by krealloc to avoid a copy, block keeps its address
+ * @param page head page of the allocated block
+ * @param order new order of the block, should be less than MAX_ORDER
+ * @return ESUCCESS if the block now has the new order, EFAILURE otherwise
+ */
+uint8_t buddy_extend_block(page_t *page, uint8_t order);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,161 @@
+#include "cma.h"
+#include "assert.h"
+#include "board.h"
+#include "buddy_alloc.h"
+#include "compaction.h"
+#include "errno.h"
+#include "spinlock.h"
+#include "util.h"
+
+/*ranges are made of whole max order blocks*/
+#define PAGEBLOCK_SIZE (PAGE_SIZE * BIT(MAX_ORDER - 1))
+#define PAGEBLOCK_PAGES BIT(MAX_ORDER - 1)
+#define CMA_PAGEBLOCKS (CMA_SIZE / PAGEBLOCK_SIZE)
+#define CMA_BITMAP_WORDS                                                       \
+  ((CMA_PAGEBLOCKS + BITS_PER_UINT64 - 1U) / BITS_PER_UINT64)
+
+/**
+ * @brief one bit per max order block of cma zone, set while the block is
+ * part of a range which is handed out or being built
+ */
+static uint64_t cma_bitmap[CMA_BITMAP_WORDS];
+static DECALRE_SPINLOCK(cma_lock);
+
+/**
+ * @brief check if max order block idx of cma zone is claimed
+ * should be called with cma_lock held
+ */
+static uint8_t cma_block_claimed(uint64_t idx) {
+  return (uint8_t)((cma_bitmap[idx / BITS_PER_UINT64] >>
+                    (idx % BITS_PER_UINT64)) &
+                   1UL);
+}
+
+/**
+ * @brief claim or unclaim nr_blocks max order blocks from first
+ *
+ */
+static void cma_mark_blocks(uint64_t first, uint64_t nr_blocks,
+                            uint8_t claim) {
+  spinlock_acquire(&cma_lock);
+  for (uint64_t idx = first; idx < (first + nr_blocks); idx++) {
+    if (claim) {
+      cma_bitmap[idx / BITS_PER_UINT64] |= BIT(idx % BITS_PER_UINT64);
+    } else {
+      cma_bitmap[idx / BITS_PER_UINT64] &= ~BIT(idx % BITS_PER_UINT64);
+    }
+  }
+  spinlock_release(&cma_lock);
+}
+
+/**
+ * @brief find and claim first run of nr_blocks unclaimed max order blocks at
+ * or after from
+ * @return index of first block of the run, total if no run is there
+ */
+static uint64_t cma_claim_run(uint64_t from, uint64_t nr_blocks,
+                              uint64_t total) {
+  uint64_t run = total;
+
+  spinlock_acquire(&cma_lock);
+  uint64_t count = 0;
+  for (uint64_t idx = from; idx < total; idx++) {
+    count = cma_block_claimed(idx) ? 0 : (count + 1U);
+    if (count == nr_blocks) {
+      run = idx + 1U - nr_blocks;
+      break;
+    }
+  }
+  if (run != total) {
+    for (uint64_t idx = run; idx < (run + nr_blocks); idx++) {
+      cma_bitmap[idx / BITS_PER_UINT64] |= BIT(idx % BITS_PER_UINT64);
+    }
+  }
+  spinlock_release(&cma_lock);
+  return run;
+}
+
+/**
+ * @brief allocate a physically contiguous range from cma zone
+ * working:
+ * - claim a run of max order blocks so no other range is built over it
+ * - isolate every block of the run, this migrates the movable blocks which
+ * were borrowing the memory
+ * - if a block is pinned give the run back and try after that block
+ */
+page_t *cma_alloc(uint64_t nr_pages) {
+  zone_t *zone = get_zone_info(ZONE_CMA);
+  if ((zone == NULL) || !zone->allocatable || (nr_pages == 0U)) {
+    return NULL;
+  }
+
+  uint64_t nr_blocks = (nr_pages + PAGEBLOCK_PAGES - 1U) / PAGEBLOCK_PAGES;
+  uint64_t base = _alignto(zone->start_addr, PAGEBLOCK_SIZE);
+  uint64_t total = (_aligntill((zone->start_addr + zone->size),
+                               PAGEBLOCK_SIZE) -
+                    base) /
+                   PAGEBLOCK_SIZE;
+  assert(total <= CMA_PAGEBLOCKS);
+
+  uint64_t from = 0;
+  while ((from + nr_blocks) <= total) {
+    uint64_t run = cma_claim_run(from, nr_blocks, total);
+    if (run == total) {
+      break; /*no free run left*/
+    }
+
+    uint64_t done = 0;
+    while ((done < nr_blocks) &&
+           (isolate_pageblock(base + ((run + done) * PAGEBLOCK_SIZE)) ==
+            ESUCCESS)) {
+      done++;
+    }
+
+    if (done == nr_blocks) {
+      /*whole range is ours, first page describes it*/
+      uint64_t address = base + (run * PAGEBLOCK_SIZE);
+      page_t *page = get_page_struct(get_page_indx(address));
+      page->order = MAX_ORDER - 1;
+      page->pfn = (uint32_t)get_page_indx(address);
+      page->zone_id = ZONE_CMA;
+      page->flags = 0U;
+      page->page_owner = OWNER_CMA;
+      page->nr_pages = nr_blocks * PAGEBLOCK_PAGES;
+      return page;
+    }
+
+    /*a block is pinned, give back what we got and try after it*/
+    for (uint64_t idx = 0; idx < done; idx++) {
+      buddy_putback_pageblock(zone, base + ((run + idx) * PAGEBLOCK_SIZE));
+    }
+    cma_mark_blocks(run, nr_blocks, 0U);
+    from = run + done + 1U;
+  }
+
+  printk_error("cma_alloc: No range found for %u pages!!!\n", nr_pages);
+  return NULL;
+}
+
+/**
+ * @brief give a range from cma_alloc back to cma zone
+ *
+ */
+void cma_free(page_t *page) {
+  zone_t *zone = get_zone_info(ZONE_CMA);
+  if (!page) {
+    return;
+  }
+  assert(page->page_owner == OWNER_CMA);
+
+  uint64_t address = get_page_addr(page);
+  uint64_t nr_blocks = page->nr_pages / PAGEBLOCK_PAGES;
+  uint64_t first =
+      (address - _alignto(zone->start_addr, PAGEBLOCK_SIZE)) / PAGEBLOCK_SIZE;
+
+  page->page_owner = OWNER_COUNT;
+  page->nr_pages = 0;
+  for (uint64_t idx = 0; idx < nr_blocks; idx++) {
+    buddy_putback_pageblock(zone, address + (idx * PAGEBLOCK_SIZE));
+  }
+  cma_mark_blocks(first, nr_blocks, 0U);
+}
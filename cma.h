@@ -0,0 +1,23 @@
+#ifndef __CMA_H__
+#define __CMA_H__
+
+#include "mm.h"
+#include <stdint.h>
+
+/**
+ * @brief allocate a physically contiguous range from cma zone
+ * range is built from whole max order blocks, movable blocks borrowed from
+ * the zone meanwhile are migrated out of it
+ * @param nr_pages no of pages needed, rounded up to max order blocks
+ * @return first page of the range with OWNER_CMA, NULL if no range can be
+ * freed
+ */
+page_t *cma_alloc(uint64_t nr_pages);
+
+/**
+ * @brief give a range from cma_alloc back to cma zone
+ * @param page first page of the range
+ */
+void cma_free(page_t *page);
+
+#endif
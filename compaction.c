@@ -0,0 +1,322 @@
+#include "compaction.h"
+#include "aarch64.h"
+#include "atomic.h"
+#include "board.h"
+#include "buddy_alloc.h"
+#include "errno.h"
+#include "slab.h"
+#include "timer.h"
+#include "util.h"
+
+/*compaction works on one max order block at a time*/
+#define PAGEBLOCK_SIZE (PAGE_SIZE * BIT(MAX_ORDER - 1))
+#define PAGEBLOCK_PAGES BIT(MAX_ORDER - 1)
+#define ORDER_SIZE(n) (PAGE_SIZE * BIT(n))
+/*no of max order blocks tried in one compact_memory call*/
+#define COMPACT_MAX_PAGEBLOCKS 8U
+
+/**
+ * @brief set while a cpu is compacting, compaction allocates migration
+ * targets itself so this also stops it from recursing
+ */
+static _Atomic uint8_t compaction_running = 0U;
+
+/**
+ * @brief last background compaction run per cpu
+ *
+ */
+static uint64_t last_idle_run[MAX_CPUS];
+
+/**
+ * @brief mark an allocated block as movable so compaction can migrate it
+ *
+ */
+void page_set_movable(page_t *page, const movable_ops_t *ops) {
+  page->page_owner = OWNER_MOVABLE;
+  page->mops = ops;
+}
+
+/**
+ * @brief fragmentation index of an order over all allocatable zones
+ * index = 1000 - (1000 + free_pages * 1000 / requested_pages) / free_blocks
+ * free block counters are read without zone lock, it is only a hint
+ */
+int32_t fragmentation_index(uint8_t order) {
+  uint64_t free_pages = 0;
+  uint64_t free_blocks = 0;
+
+  for (uint8_t zone_idx = 0; zone_idx < ZONES_COUNT; zone_idx++) {
+    zone_t *zone = get_zone_info(zone_idx);
+    /*free cma blocks can't serve the allocations compaction works for*/
+    if (!zone->allocatable || (zone_idx == ZONE_CMA)) {
+      continue;
+    }
+    for (uint8_t current = 0; current < MAX_ORDER; current++) {
+      uint64_t nr_free = zone->area[current].nr_free;
+      if ((current >= order) && (nr_free != 0U)) {
+        return FRAG_INDEX_ALLOC_OK;
+      }
+      free_blocks += nr_free;
+      free_pages += nr_free << current;
+    }
+  }
+
+  if (free_blocks == 0U) {
+    return 0; /*no memory at all*/
+  }
+  return (int32_t)(1000U -
+                   ((1000U + ((free_pages * 1000U) / BIT(order))) /
+                    free_blocks));
+}
+
+/**
+ * @brief score a max order block for compaction by walking its blocks
+ * free and empty slab pages come for free, movable blocks need a copy
+ * read without locks so it is only a hint
+ * @return 0 if block is already free or has a block which cannot be moved,
+ * else 1 + no of pages which don't need a copy
+ */
+static uint64_t pageblock_score(uint64_t start) {
+  uint64_t score = 1U;
+
+  for (uint64_t addr = start; addr < (start + PAGEBLOCK_SIZE);) {
+    page_t *page = get_page_struct(get_page_indx(addr));
+    uint8_t order = page->order;
+    if (order >= MAX_ORDER) {
+      return 0; /*changing under us*/
+    }
+
+    if (page->flags & PG_BUDDY) {
+      if (order == (MAX_ORDER - 1)) {
+        return 0; /*nothing to do*/
+      }
+      score += BIT(order);
+    } else if (page->page_owner == OWNER_SLAB) {
+      if (!kmem_cache_slab_empty(page)) {
+        return 0;
+      }
+      score += BIT(order);
+    } else if (page->page_owner != OWNER_MOVABLE) {
+      return 0; /*pinned*/
+    }
+    addr += ORDER_SIZE(order);
+  }
+  return score;
+}
+
+/**
+ * @brief pick the max order block which is closest to be free
+ * @param zone filled with the zone of the block
+ * @param skip blocks which already failed in this run
+ * @param nskip no of entries in skip
+ * @return start address of the block, 0 if no block can be compacted
+ */
+static uint64_t compaction_pick_pageblock(zone_t **zone, uint64_t *skip,
+                                          uint8_t nskip) {
+  uint64_t best = 0;
+  uint64_t best_score = 0;
+
+  for (uint8_t zone_idx = 0; zone_idx < ZONES_COUNT; zone_idx++) {
+    zone_t *current_zone = get_zone_info(zone_idx);
+    /*cma zone only has movable blocks which can always be moved on demand*/
+    if (!current_zone->allocatable || (zone_idx == ZONE_CMA)) {
+      continue;
+    }
+
+    /*only max order blocks fully inside the zone and already handed to
+    buddy by deferred init*/
+    uint64_t end = current_zone->start_addr + current_zone->size;
+    uint64_t deferred_next = atomic_load_relaxed(&current_zone->deferred_next);
+    if (deferred_next < end) {
+      end = deferred_next;
+    }
+    end = _aligntill(end, PAGEBLOCK_SIZE);
+
+    for (uint64_t start = _alignto(current_zone->start_addr, PAGEBLOCK_SIZE);
+         start < end; start += PAGEBLOCK_SIZE) {
+      uint8_t skipped = 0;
+      for (uint8_t idx = 0; idx < nskip; idx++) {
+        skipped |= (skip[idx] == start);
+      }
+      if (skipped) {
+        continue;
+      }
+
+      uint64_t score = pageblock_score(start);
+      if (score > best_score) {
+        best = start;
+        best_score = score;
+        *zone = current_zone;
+        if (score > ((PAGEBLOCK_PAGES * 3U) / 4U)) {
+          return best; /*good enough, no need to walk the rest*/
+        }
+      }
+    }
+  }
+  return best;
+}
+
+/**
+ * @brief move a movable block to a new block outside the max order block
+ * being compacted
+ * @return ESUCCESS if old block is not used by its owner anymore
+ */
+static uint8_t migrate_block(page_t *page, uint64_t start) {
+  uint8_t order = page->order;
+  const movable_ops_t *ops = page->mops;
+
+  page_t *new_page = get_free_pages(order);
+  if (new_page == NULL) {
+    return EFAILURE;
+  }
+  /*freed meanwhile into the block being compacted*/
+  uint64_t new_addr = get_page_addr(new_page);
+  if (((new_addr >= start) && (new_addr < (start + PAGEBLOCK_SIZE))) ||
+      (ops->migrate(page, new_page) != ESUCCESS)) {
+    free_pages(new_page, order);
+    return EFAILURE;
+  }
+
+  page_set_movable(new_page, ops);
+  page->page_owner = OWNER_COUNT;
+  page->mops = NULL;
+  return ESUCCESS;
+}
+
+/**
+ * @brief drop PG_ISOLATED from every block held in the max order block
+ * @param putback give the held blocks back to buddy freelists, else caller
+ * keeps the whole max order block
+ */
+static void release_isolated(uint64_t start, uint8_t putback) {
+  /*only heads held in this run have PG_ISOLATED, so page by page scan finds
+  all of them*/
+  for (uint64_t addr = start; addr < (start + PAGEBLOCK_SIZE);) {
+    page_t *page = get_page_struct(get_page_indx(addr));
+    if (!(page->flags & PG_ISOLATED)) {
+      addr += get_page_size();
+      continue;
+    }
+    addr += ORDER_SIZE(page->order);
+    if (putback) {
+      buddy_putback_block(page);
+    } else {
+      page->flags = 0U;
+    }
+  }
+}
+
+/**
+ * @brief take a whole max order block out of buddy allocator
+ *
+ */
+uint8_t isolate_pageblock(uint64_t start) {
+  uint8_t ret = ESUCCESS;
+
+  /*take free blocks out first so that migration targets come from other
+  blocks*/
+  for (uint64_t addr = start; addr < (start + PAGEBLOCK_SIZE);) {
+    page_t *page = get_page_struct(get_page_indx(addr));
+    uint8_t order = page->order;
+    if (page->flags & PG_BUDDY) {
+      order = buddy_isolate_free_block(page);
+      if (order == MAX_ORDER) {
+        continue; /*changed meanwhile, look again*/
+      }
+    }
+    addr += ORDER_SIZE(order);
+  }
+
+  /*now everything else should be moved out or released*/
+  for (uint64_t addr = start; addr < (start + PAGEBLOCK_SIZE);) {
+    page_t *page = get_page_struct(get_page_indx(addr));
+    if (page->flags & PG_ISOLATED) {
+      /*already held*/
+    } else if (page->flags & PG_BUDDY) {
+      if (buddy_isolate_free_block(page) == MAX_ORDER) {
+        continue; /*changed meanwhile, look again*/
+      }
+    } else if ((page->page_owner == OWNER_SLAB) &&
+               (kmem_cache_detach_empty_slab(page) == ESUCCESS)) {
+      page->flags = PG_ISOLATED;
+    } else if ((page->page_owner == OWNER_MOVABLE) &&
+               (migrate_block(page, start) == ESUCCESS)) {
+      page->flags = PG_ISOLATED;
+    } else {
+      ret = EFAILURE; /*pinned block*/
+      break;
+    }
+    addr += ORDER_SIZE(page->order);
+  }
+
+  /*on failure give back whatever was taken*/
+  release_isolated(start, (ret != ESUCCESS));
+  return ret;
+}
+
+/**
+ * @brief free a whole max order block by isolating it and giving it back as
+ * one block
+ * @return ESUCCESS if the max order block is free now
+ */
+static uint8_t compact_pageblock(zone_t *zone, uint64_t start) {
+  if (isolate_pageblock(start) != ESUCCESS) {
+    return EFAILURE;
+  }
+  buddy_putback_pageblock(zone, start);
+  return ESUCCESS;
+}
+
+/**
+ * @brief compact memory till a free block of order is available
+ *
+ */
+uint8_t compact_memory(uint8_t order) {
+  uint64_t failed[COMPACT_MAX_PAGEBLOCKS];
+  uint8_t nfailed = 0;
+
+  if (order >= MAX_ORDER) {
+    return EFAILURE;
+  }
+  /*only one cpu compacts at a time, others fail fast*/
+  if (atomic_exchange_explicit(&compaction_running, 1U,
+                               memory_order_acquire)) {
+    return EFAILURE;
+  }
+
+  /*cached blocks of this cpu look pinned to compaction*/
+  drain_local_pages();
+  while ((fragmentation_index(order) != FRAG_INDEX_ALLOC_OK) &&
+         (nfailed < COMPACT_MAX_PAGEBLOCKS)) {
+    zone_t *zone = NULL;
+    uint64_t start = compaction_pick_pageblock(&zone, failed, nfailed);
+    if (start == 0U) {
+      break; /*nothing can be compacted*/
+    }
+    if (compact_pageblock(zone, start) != ESUCCESS) {
+      failed[nfailed++] = start;
+    }
+  }
+  uint8_t ret =
+      (fragmentation_index(order) == FRAG_INDEX_ALLOC_OK) ? ESUCCESS : EFAILURE;
+
+  atomic_store_release(&compaction_running, 0U);
+  return ret;
+}
+
+/**
+ * @brief background compaction, called from idle loop of every cpu
+ *
+ */
+void compaction_idle_work(void) {
+  uint64_t cpu_id = get_mpidr() & MPIDR_AFF0_MASK;
+  uint64_t now = get_system_timestamp_ns();
+  if ((now - last_idle_run[cpu_id]) < COMPACTION_IDLE_INTERVAL_NS) {
+    return;
+  }
+  last_idle_run[cpu_id] = now;
+
+  if (fragmentation_index(MAX_ORDER - 1) > FRAG_INDEX_THRESHOLD) {
+    compact_memory(MAX_ORDER - 1);
+  }
+}
@@ -0,0 +1,77 @@
+#ifndef __COMPACTION_H__
+#define __COMPACTION_H__
+
+#include "mm.h"
+#include <stdint.h>
+
+/**
+ * @brief fragmentation index when an allocation of the order would succeed
+ *
+ */
+#define FRAG_INDEX_ALLOC_OK (-1000)
+
+/**
+ * @brief fragmentation index above which compaction is worth running, below
+ * it an allocation failure is due to lack of memory rather than fragmentation
+ */
+#define FRAG_INDEX_THRESHOLD 500
+
+/**
+ * @brief background compaction runs at most once per interval on every cpu
+ *
+ */
+#define COMPACTION_IDLE_INTERVAL_NS 100000000UL /*100ms*/
+
+/**
+ * @brief operations of an OWNER_MOVABLE page
+ * owner must not free the page while migrate is running
+ */
+typedef struct movable_ops {
+  /*copy contents of old block to new block and update every reference the
+  owner keeps, called without any lock held
+  return ESUCCESS if owner now uses new block*/
+  uint8_t (*migrate)(page_t *old_page, page_t *new_page);
+} movable_ops_t;
+
+/**
+ * @brief mark an allocated block as movable so compaction can migrate it
+ * @param page head page of the block
+ * @param ops how to migrate the block
+ */
+void page_set_movable(page_t *page, const movable_ops_t *ops);
+
+/**
+ * @brief fragmentation index of an order over all allocatable zones except
+ * cma zone
+ * @param order of the allocation
+ * @return FRAG_INDEX_ALLOC_OK if a free block of order is there, else value
+ * in [0, 1000], towards 0 failure is due to lack of memory, towards 1000 it
+ * is due to fragmentation
+ */
+int32_t fragmentation_index(uint8_t order);
+
+/**
+ * @brief take a whole max order block out of buddy allocator by isolating its
+ * free blocks, releasing empty slabs and migrating movable blocks
+ * @param start address of the max order block, should be inside a zone
+ * @return ESUCCESS if caller owns the whole block now, else nothing is held
+ */
+uint8_t isolate_pageblock(uint64_t start);
+
+/**
+ * @brief compact memory till a free block of order is available
+ * empty slabs are released and movable blocks are migrated out of the max
+ * order block which is closest to be free, only one cpu compacts at a time
+ * @param order of the allocation
+ * @return ESUCCESS if a free block of order is available
+ */
+uint8_t compact_memory(uint8_t order);
+
+/**
+ * @brief background compaction, called from idle loop of every cpu
+ * compacts for max order when fragmentation index crosses
+ * FRAG_INDEX_THRESHOLD
+ */
+void compaction_idle_work(void);
+
+#endif
@@ -1,4 +1,9 @@
 #include "idle.h"
+#include "buddy_alloc.h"
+#include "compaction.h"
+#include "mempool.h"
+#include "shrinker.h"
+#include "slab.h"
 
 /**
  * @brief idle thread init function
@@ -27,5 +32,11 @@ void idle_thread_init(uint64_t cpuid) {
 void idle() {
   while (1) {
     // never returns
+    /*no scheduler yet, so background memory work runs from here*/
+    reclaim_idle_work();
+    slab_reap_idle_work();
+    zero_pool_refill();
+    mempool_refill_idle_work();
+    compaction_idle_work();
   }
 }
@@ -3,10 +3,14 @@
 #include "assert.h"
 #include "atomic.h"
 #include "board.h"
+#include "buddy_alloc.h"
+#include "errno.h"
 #include "gic.h"
 #include "idle.h"
 #include "mm.h"
+#include "mmu.h"
 #include "psci.h"
+#include "slab.h"
 #include "timer.h"
 #include <stdint.h>
 
@@ -84,11 +88,271 @@ void print_test() {
                -123, 1024);
 }
 
+#if MM_BUDDY_STRESS_TEST
+/**
+ * @brief buddy free latency stress test
+ *
+ * frees the odd pfn pages first, their buddies are still allocated so they
+ * pile up as order 0 free blocks, then frees the even pfn pages which have to
+ * unlink their buddy from that list while merging
+ * free latency should stay flat as no of free blocks grows
+ * @param None
+ * @return
+ */
+void buddy_free_stress_test(void) {
+  /*one max order block holds the page pointers*/
+  page_t *array_page = get_free_pages(MAX_ORDER - 1);
+  page_t **pages = (page_t **)get_page_addr(array_page);
+  uint64_t max_pages =
+      (BIT(MAX_ORDER - 1) * get_page_size()) / sizeof(page_t *);
+
+  for (uint64_t nr_pages = 2048; nr_pages <= max_pages; nr_pages *= 2) {
+    uint64_t nr_free_blocks = 0;
+    for (uint64_t idx = 0; idx < nr_pages; idx++) {
+      pages[idx] = get_free_page();
+      assert(pages[idx] != NULL);
+    }
+    /*free odd pages, no merge possible*/
+    for (uint64_t idx = 0; idx < nr_pages; idx++) {
+      if (pages[idx]->pfn & 1U) {
+        free_page(pages[idx]);
+        pages[idx] = NULL;
+        nr_free_blocks++;
+      }
+    }
+    drain_local_pages();
+
+    /*free even pages, every free has to unlink its buddy*/
+    uint64_t start = get_system_timestamp_ns();
+    for (uint64_t idx = 0; idx < nr_pages; idx++) {
+      if (pages[idx] != NULL) {
+        free_page(pages[idx]);
+      }
+    }
+    drain_local_pages();
+    uint64_t elapsed = get_system_timestamp_ns() - start;
+
+    printk_info("buddy_free_stress_test: free_blocks:%u free_latency:%uns\n",
+                nr_free_blocks, elapsed / (nr_pages - nr_free_blocks));
+  }
+
+  free_pages(array_page, MAX_ORDER - 1);
+}
+#endif
+
+#if MM_SLAB_COLOUR_TEST
+#define SLAB_COLOUR_TEST_OBJS 128
+#define SLAB_COLOUR_TEST_ROUNDS 1024
+#define SLAB_COLOUR_TEST_SIZE 3072
+/*sets of a 32KB 8 way l1 data cache with CACHE_LINE_SIZE lines*/
+#define SLAB_COLOUR_TEST_SETS 64
+
+/**
+ * @brief walk first word of every object, like a list walk reading the
+ * object header
+ * @return time taken in ns
+ */
+static uint64_t slab_colour_walk(volatile uint64_t **objs) {
+  uint64_t sum = 0;
+  uint64_t start = get_system_timestamp_ns();
+  for (uint64_t round = 0; round < SLAB_COLOUR_TEST_ROUNDS; round++) {
+    for (uint64_t idx = 0; idx < SLAB_COLOUR_TEST_OBJS; idx++) {
+      sum += *objs[idx];
+    }
+  }
+  uint64_t elapsed = get_system_timestamp_ns() - start;
+  assert(sum == 0U);
+  return elapsed;
+}
+
+/**
+ * @brief print how object 0 of every slab spreads over cache sets
+ * it is computed from the addresses, so it doesn't depend on a cache model
+ */
+static void slab_colour_histogram(const char *name, volatile uint64_t **objs) {
+  uint32_t sets[SLAB_COLOUR_TEST_SETS];
+  uint32_t used = 0;
+  uint32_t max = 0;
+  memset(sets, 0x0, sizeof(sets));
+  for (uint64_t idx = 0; idx < SLAB_COLOUR_TEST_OBJS; idx++) {
+    uint64_t addr = (uint64_t)objs[idx];
+    page_t *page = get_page_struct(get_page_indx(addr));
+    if (addr != page->owner_slab->smem) {
+      continue;
+    }
+    uint64_t set = (addr / CACHE_LINE_SIZE) % SLAB_COLOUR_TEST_SETS;
+    used += (sets[set] == 0U);
+    sets[set]++;
+    max = (sets[set] > max) ? sets[set] : max;
+  }
+  printk_info("slab_colour_test: %s sets used:%u max objs in a set:%u\n",
+              name, used, max);
+  for (uint64_t set = 0; set < SLAB_COLOUR_TEST_SETS; set++) {
+    if (sets[set] != 0U) {
+      printk_info("slab_colour_test: %s set:%u objs:%u\n", name, set,
+                  sets[set]);
+    }
+  }
+}
+
+/**
+ * @brief slab colouring benchmark
+ *
+ * few objects of SLAB_COLOUR_TEST_SIZE fit a slab, so without colouring
+ * object n of every slab starts at the same offset and their headers fight
+ * for the same cache sets, with colouring slabs start at upto 16 offsets
+ * set histogram of object 0 of every slab is printed for a cache with
+ * colouring turned off and a normal one, coloured one should use upto 16
+ * sets instead of 1
+ * same walk is timed too but it only shows the effect on hardware, mmu is
+ * off at this point so accesses are not cached and qemu doesn't model
+ * caches anyway
+ * @param None
+ * @return
+ */
+void slab_colour_test(void) {
+  volatile uint64_t *objs[SLAB_COLOUR_TEST_OBJS];
+  kmem_cache_t *caches[] = {kmem_cache_create("colour_off",
+                                               SLAB_COLOUR_TEST_SIZE, 0,
+                                               KMEM_CACHE_NO_COLOUR, NULL),
+                             kmem_cache_create("colour_on",
+                                               SLAB_COLOUR_TEST_SIZE, 0, 0U,
+                                               NULL)};
+  assert((caches[0] != NULL) && (caches[1] != NULL));
+
+  for (uint8_t idx = 0; idx < (sizeof(caches) / sizeof(caches[0])); idx++) {
+    for (uint64_t obj = 0; obj < SLAB_COLOUR_TEST_OBJS; obj++) {
+      objs[obj] = kmem_cache_alloc_obj(caches[idx]);
+      assert(objs[obj] != NULL);
+      *objs[obj] = 0;
+    }
+    slab_colour_histogram(caches[idx]->name, objs);
+    uint64_t elapsed = slab_colour_walk(objs);
+    printk_info("slab_colour_test: %s colours:%u objs:%u time:%uns\n",
+                caches[idx]->name, caches[idx]->colour, SLAB_COLOUR_TEST_OBJS,
+                elapsed);
+    for (uint64_t obj = 0; obj < SLAB_COLOUR_TEST_OBJS; obj++) {
+      kmem_cache_free_obj(caches[idx], (void *)objs[obj]);
+    }
+    if (kmem_cache_destroy(caches[idx]) != ESUCCESS) {
+      fatal("slab_colour_test: cache destroy failed\n");
+    }
+  }
+}
+#endif
+
+#if MM_SLAB_FREEPTR_TEST
+#define SLAB_FREEPTR_TEST_OBJS 2048
+#define SLAB_FREEPTR_TEST_ROUNDS 16
+
+/**
+ * @brief free pointer vs bufctl slab layout benchmark
+ *
+ * a cache of each layout is filled with SLAB_FREEPTR_TEST_OBJS objects and
+ * emptied again for some object sizes, most of them miss the magazines and go
+ * through slab freelists, prints objects per slab and time per alloc/free
+ * pair, free pointer layout should pack more small objects and take less
+ * time since bufctl array is not touched
+ * @param None
+ * @return
+ */
+void slab_freeptr_test(void) {
+  static const uint16_t sizes[] = {8, 64, 256, 1024};
+  void **objs = kmalloc(SLAB_FREEPTR_TEST_OBJS * sizeof(void *));
+  assert(objs != NULL);
+
+  for (uint8_t size = 0; size < (sizeof(sizes) / sizeof(sizes[0])); size++) {
+    for (uint8_t freeptr = 0; freeptr < 2U; freeptr++) {
+      kmem_cache_t *cache =
+          kmem_cache_create(freeptr ? "freeptr" : "bufctl", sizes[size], 0,
+                            freeptr ? KMEM_CACHE_FREEPTR : 0U, NULL);
+      assert(cache != NULL);
+      uint64_t start = get_system_timestamp_ns();
+      for (uint64_t round = 0; round < SLAB_FREEPTR_TEST_ROUNDS; round++) {
+        for (uint64_t obj = 0; obj < SLAB_FREEPTR_TEST_OBJS; obj++) {
+          objs[obj] = kmem_cache_alloc_obj(cache);
+          assert(objs[obj] != NULL);
+        }
+        for (uint64_t obj = 0; obj < SLAB_FREEPTR_TEST_OBJS; obj++) {
+          kmem_cache_free_obj(cache, objs[obj]);
+        }
+      }
+      uint64_t elapsed = get_system_timestamp_ns() - start;
+      printk_info("slab_freeptr_test: %s size:%u objs/slab:%u order:%u "
+                  "alloc+free:%uns\n",
+                  cache->name, sizes[size], cache->nr_objs, cache->order,
+                  elapsed /
+                      (SLAB_FREEPTR_TEST_ROUNDS * SLAB_FREEPTR_TEST_OBJS));
+      if (kmem_cache_destroy(cache) != ESUCCESS) {
+        fatal("slab_freeptr_test: cache destroy failed\n");
+      }
+    }
+  }
+  kfree(objs);
+}
+#endif
+
+#if MM_SMP_STRESS_TEST
+#define MM_SMP_STRESS_ITERS 4096
+
+static _Atomic uint64_t mm_smp_barrier_count = 0;
+
+/**
+ * @brief wait till all the cpus reach this point, phase is per cpu no of
+ * barriers crossed so far
+ */
+static void mm_smp_barrier(uint64_t *phase) {
+  (*phase)++;
+  atomic_fetch_add_explicit(&mm_smp_barrier_count, 1, memory_order_acq_rel);
+  while (atomic_load_acquire(&mm_smp_barrier_count) < (*phase * MAX_CPUS)) {
+  }
+}
+
+/**
+ * @brief smp allocator scalability stress test
+ *
+ * runs rounds with 1 to MAX_CPUS cpus doing kmalloc/kfree of small sizes and
+ * get_free_page/free_page at the same time, cpu 0 prints throughput of
+ * every round, it should grow with no of cpus instead of flattening on a
+ * global lock
+ * @param cpu_id current cpu id
+ * @return
+ */
+void mm_smp_stress_test(uint64_t cpu_id) {
+  uint64_t phase = 0;
+  for (uint64_t nr_cpus = 1; nr_cpus <= MAX_CPUS; nr_cpus++) {
+    mm_smp_barrier(&phase);
+    uint64_t start = get_system_timestamp_ns();
+    if (cpu_id < nr_cpus) {
+      for (uint64_t iter = 0; iter < MM_SMP_STRESS_ITERS; iter++) {
+        size_t size = 16U << (iter % 8U); /*16 to 2048 bytes*/
+        uint8_t *ptr = kmalloc(size);
+        page_t *page = get_free_page();
+        assert((ptr != NULL) && (page != NULL));
+        ptr[0] = (uint8_t)cpu_id;
+        ptr[size - 1] = (uint8_t)cpu_id;
+        kfree(ptr);
+        free_page(page);
+      }
+    }
+    mm_smp_barrier(&phase);
+    uint64_t elapsed = get_system_timestamp_ns() - start;
+    if (cpu_id == 0) {
+      /*every iteration does 4 allocator operations*/
+      uint64_t ops = nr_cpus * MM_SMP_STRESS_ITERS * 4U;
+      printk_info("mm_smp_stress_test: cpus:%u ops:%u time:%uns ops/ms:%u\n",
+                  nr_cpus, ops, elapsed, (ops * 1000000U) / (elapsed + 1U));
+    }
+  }
+}
+#endif
+
 /**
  * @brief primary core 0 cold boot init
  * Main function to setup initalize the system after _start
  *
  * enable floating pointer simd access
+ * enable mmu and caches
  * test atomic functions working
  * test fomatiing prink function working
  * commented : test spx elx sync exception testing
@@ -101,8 +365,16 @@ void primary_boot_cold_init() {
   // set current log level
   set_current_log_level(INFO);
 
+  /*identity map with caches on, heap setup below runs on cached memory*/
+  mmu_init();
+
   /*setup the heap management*/
+  uint64_t mem_init_start = get_system_timestamp_ns();
   boot_mem_init();
+  printk_info("boot_mem_init: took %uns\n",
+              get_system_timestamp_ns() - mem_init_start);
+  /*threads come from their own cache*/
+  thread_cache_init();
 
   /*set the current cpu information*/
   uint64_t affinity = get_mpidr();
@@ -127,10 +399,31 @@ void primary_boot_cold_init() {
   // Platoform timer init
   platform_timer_init();
 
+#if MM_BUDDY_STRESS_TEST
+  // buddy free latency should not grow with no of free blocks
+  buddy_free_stress_test();
+#endif
+
+#if MM_SLAB_COLOUR_TEST
+  // object walk should be faster with slab colouring
+  slab_colour_test();
+#endif
+
+#if MM_SLAB_FREEPTR_TEST
+  // free pointer slabs should be denser and faster than bufctl slabs
+  slab_freeptr_test();
+#endif
+
   /*put the secondary core out of reset*/
   for (uint8_t id = 1; id < MAX_CPUS; id++) {
     psci_cpu_on(id, (uint64_t)_start);
   }
+
+#if MM_SMP_STRESS_TEST
+  // allocator throughput should scale with no of cpus
+  mm_smp_stress_test(cpu_id);
+#endif
+
   /*call idle thread*/
   idle();
 }
@@ -140,6 +433,9 @@ void primary_boot_cold_init() {
  *
  */
 void secondary_boot_cold_init() {
+  /*mmu was turned on in boot.S before the stack was used*/
+  mmu_check();
+
   /*set the current cpu information*/
   uint64_t affinity = get_mpidr();
   uint64_t cpu_id = affinity & MPIDR_AFF0_MASK;
@@ -165,6 +461,16 @@ void secondary_boot_cold_init() {
   // Platoform timer init
   platform_timer_init();
 
+  /*hand rest of the heap to buddy allocator, shared with other secondaries*/
+  uint64_t mem_init_start = get_system_timestamp_ns();
+  deferred_init_memory();
+  printk_info("deferred_init_memory: cpu:%u took %uns\n", cpu_id,
+              get_system_timestamp_ns() - mem_init_start);
+
+#if MM_SMP_STRESS_TEST
+  mm_smp_stress_test(cpu_id);
+#endif
+
   /*call idle thread*/
   idle();
 }
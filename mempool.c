@@ -0,0 +1,389 @@
+#include "mempool.h"
+#include "aarch64.h"
+#include "assert.h"
+#include "buddy_alloc.h"
+#include "errno.h"
+#include "psw.h"
+#include "spinlock.h"
+#include "util.h"
+
+/**
+ * @brief circular list of pools, refilled from idle loop
+ *
+ */
+static mempool_t *mempool_list = NULL;
+static DECALRE_SPINLOCK(mempool_list_lock);
+
+/**
+ * @brief get current cpu reserve of a pool, should be called with irq
+ * disabled
+ */
+static mempool_cpu_t *get_cpu_reserve(mempool_t *pool) {
+  return &pool->cpu[get_mpidr() & MPIDR_AFF0_MASK];
+}
+
+/**
+ * @brief room of a cpu reserve, min_nr elements and as many overflow slots
+ * for elements put back from isr
+ */
+static uint32_t reserve_capacity(mempool_t *pool) { return 2U * pool->min_nr; }
+
+/**
+ * @brief take an element from current cpu reserve
+ * @return element or NULL if reserve is empty
+ */
+static void *reserve_get(mempool_t *pool) {
+  psw_t psw;
+  void *element = NULL;
+
+  psw_disable_and_save_interrupt(&psw);
+  mempool_cpu_t *reserve = get_cpu_reserve(pool);
+  if (reserve->curr_nr != 0U) {
+    element = reserve->elements[--reserve->curr_nr];
+    if (reserve->curr_nr < reserve->low_nr) {
+      reserve->low_nr = reserve->curr_nr;
+    }
+    reserve->nr_alloc++;
+    reserve->nr_reserve++;
+  } else {
+    reserve->nr_fail++;
+  }
+  psw_restore_interrupt(&psw);
+  return element;
+}
+
+/**
+ * @brief put an element into current cpu reserve if it has less than limit
+ * @return ESUCCESS if element is taken, EFAILURE if reserve is full
+ */
+static uint8_t reserve_put(mempool_t *pool, void *element, uint32_t limit,
+                           uint8_t refill) {
+  psw_t psw;
+  uint8_t ret = EFAILURE;
+
+  psw_disable_and_save_interrupt(&psw);
+  mempool_cpu_t *reserve = get_cpu_reserve(pool);
+  if (reserve->curr_nr < limit) {
+    reserve->elements[reserve->curr_nr++] = element;
+    if (refill) {
+      reserve->nr_refill++;
+    }
+    ret = ESUCCESS;
+  }
+  psw_restore_interrupt(&psw);
+  return ret;
+}
+
+/**
+ * @brief count an allocation served by the allocator
+ *
+ */
+static void reserve_count_alloc(mempool_t *pool) {
+  psw_t psw;
+
+  psw_disable_and_save_interrupt(&psw);
+  get_cpu_reserve(pool)->nr_alloc++;
+  psw_restore_interrupt(&psw);
+}
+
+/**
+ * @brief take an element over min_nr out of current cpu reserve
+ * @return element or NULL if reserve has no surplus
+ */
+static void *reserve_take_surplus(mempool_t *pool) {
+  psw_t psw;
+  void *element = NULL;
+
+  psw_disable_and_save_interrupt(&psw);
+  mempool_cpu_t *reserve = get_cpu_reserve(pool);
+  if (reserve->curr_nr > pool->min_nr) {
+    element = reserve->elements[--reserve->curr_nr];
+  }
+  psw_restore_interrupt(&psw);
+  return element;
+}
+
+/**
+ * @brief bring current cpu reserve back to min_nr, surplus put back from
+ * isr goes to the allocator and a short reserve is filled from it
+ * @return ESUCCESS if reserve is full, EFAILURE if allocator ran out
+ */
+static uint8_t mempool_refill_local(mempool_t *pool) {
+  void *surplus = NULL;
+  while ((surplus = reserve_take_surplus(pool)) != NULL) {
+    pool->free(surplus, pool->pool_data);
+  }
+
+  while (1) {
+    psw_t psw;
+    psw_disable_and_save_interrupt(&psw);
+    uint8_t full = (get_cpu_reserve(pool)->curr_nr >= pool->min_nr);
+    psw_restore_interrupt(&psw);
+    if (full) {
+      return ESUCCESS;
+    }
+
+    /*allocator may take locks or reclaim, it is called with irq enabled and
+     * no lock held*/
+    void *element = pool->alloc(pool->pool_data, 0U);
+    if (element == NULL) {
+      return EFAILURE;
+    }
+    if (reserve_put(pool, element, pool->min_nr, 1U) != ESUCCESS) {
+      /*reserve got filled by frees meanwhile*/
+      pool->free(element, pool->pool_data);
+      return ESUCCESS;
+    }
+  }
+}
+
+/**
+ * @brief create a pool and fill the reserve of every cpu
+ * reserves of other cpus are filled from here since pool is not visible to
+ * them yet
+ */
+mempool_t *mempool_create(uint32_t min_nr, mempool_alloc_t alloc,
+                          mempool_free_t free, void *pool_data) {
+  if ((min_nr == 0U) || (alloc == NULL) || (free == NULL)) {
+    return NULL;
+  }
+
+  mempool_t *pool =
+      (mempool_t *)kmalloc_aligned(sizeof(mempool_t), CACHE_LINE_SIZE);
+  if (pool == NULL) {
+    return NULL;
+  }
+  void **elements =
+      (void **)kmalloc(MAX_CPUS * 2U * min_nr * sizeof(void *));
+  if (elements == NULL) {
+    kfree(pool);
+    return NULL;
+  }
+  memset(pool, 0x0, sizeof(mempool_t));
+  pool->alloc = alloc;
+  pool->free = free;
+  pool->pool_data = pool_data;
+  pool->min_nr = min_nr;
+
+  for (uint8_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+    mempool_cpu_t *reserve = &pool->cpu[cpu];
+    reserve->elements = &elements[cpu * 2U * min_nr];
+    reserve->low_nr = min_nr;
+    for (; reserve->curr_nr < min_nr; reserve->curr_nr++) {
+      void *element = alloc(pool_data, 0U);
+      if (element == NULL) {
+        mempool_destroy(pool);
+        return NULL;
+      }
+      reserve->elements[reserve->curr_nr] = element;
+    }
+  }
+
+  spinlock_acquire(&mempool_list_lock);
+  if (mempool_list == NULL) {
+    pool->next = pool;
+    pool->prev = pool;
+    mempool_list = pool;
+  } else {
+    pool->next = mempool_list;
+    pool->prev = mempool_list->prev;
+    mempool_list->prev->next = pool;
+    mempool_list->prev = pool;
+  }
+  spinlock_release(&mempool_list_lock);
+  return pool;
+}
+
+/**
+ * @brief slab pool callbacks, pool_data is the cache
+ *
+ */
+static void *mempool_alloc_slab(void *pool_data, uint32_t flags) {
+  (void)flags; /*slab allocation never waits*/
+  return kmem_cache_alloc_obj((kmem_cache_t *)pool_data);
+}
+
+static void mempool_free_slab(void *element, void *pool_data) {
+  kmem_cache_free_obj((kmem_cache_t *)pool_data, element);
+}
+
+/**
+ * @brief create a pool of objects of a slab cache
+ *
+ */
+mempool_t *mempool_create_slab_pool(uint32_t min_nr, kmem_cache_t *cache) {
+  return mempool_create(min_nr, mempool_alloc_slab, mempool_free_slab,
+                        (void *)cache);
+}
+
+/**
+ * @brief page pool callbacks, pool_data is the order
+ *
+ */
+static void *mempool_alloc_pages(void *pool_data, uint32_t flags) {
+  return alloc_pages((uint8_t)(uint64_t)pool_data, flags & ALLOC_ATOMIC);
+}
+
+static void mempool_free_pages(void *element, void *pool_data) {
+  free_pages((page_t *)element, (uint8_t)(uint64_t)pool_data);
+}
+
+/**
+ * @brief create a pool of blocks of 2^(order) pages
+ *
+ */
+mempool_t *mempool_create_page_pool(uint32_t min_nr, uint8_t order) {
+  if (order >= MAX_ORDER) {
+    return NULL;
+  }
+  return mempool_create(min_nr, mempool_alloc_pages, mempool_free_pages,
+                        (void *)(uint64_t)order);
+}
+
+/**
+ * @brief give every reserved element back and free a pool which is off the
+ * list and not pinned
+ */
+static void mempool_free_pool(mempool_t *pool) {
+  for (uint8_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+    mempool_cpu_t *reserve = &pool->cpu[cpu];
+    while (reserve->curr_nr != 0U) {
+      pool->free(reserve->elements[--reserve->curr_nr], pool->pool_data);
+    }
+  }
+  /*reserve of cpu 0 starts the elements array*/
+  kfree(pool->cpu[0].elements);
+  kfree(pool);
+}
+
+/**
+ * @brief give every reserved element back and free the pool
+ * pool is taken off the list first so idle loop doesn't refill it anymore,
+ * a refill still running on it frees the pool when it is done
+ */
+void mempool_destroy(mempool_t *pool) {
+  spinlock_acquire(&mempool_list_lock);
+  if (pool->next != NULL) {
+    if (pool->next == pool) {
+      mempool_list = NULL;
+    } else {
+      pool->prev->next = pool->next;
+      pool->next->prev = pool->prev;
+      if (mempool_list == pool) {
+        mempool_list = pool->next;
+      }
+    }
+    pool->next = NULL;
+    pool->prev = NULL;
+  }
+  uint32_t refs = pool->refs;
+  spinlock_release(&mempool_list_lock);
+
+  if (refs == 0U) {
+    mempool_free_pool(pool);
+  }
+}
+
+/**
+ * @brief allocate an element
+ * atomic allocation is a pop from current cpu reserve with irq disabled,
+ * it never touches the allocator or any lock
+ */
+void *mempool_alloc(mempool_t *pool, uint32_t flags) {
+  if (flags & ALLOC_ATOMIC) {
+    return reserve_get(pool);
+  }
+
+  /*keep the reserve for those who can't wait*/
+  void *element = pool->alloc(pool->pool_data, flags);
+  if (element != NULL) {
+    reserve_count_alloc(pool);
+    return element;
+  }
+  return reserve_get(pool);
+}
+
+/**
+ * @brief free an element, short reserve is refilled first
+ *
+ */
+void mempool_free(void *element, mempool_t *pool) {
+  if (element == NULL) {
+    return;
+  }
+  if (reserve_put(pool, element, pool->min_nr, 0U) != ESUCCESS) {
+    pool->free(element, pool->pool_data);
+  }
+}
+
+/**
+ * @brief put back an element from isr
+ * it takes an overflow slot if reserve is full, idle loop trims it later
+ */
+void mempool_free_atomic(void *element, mempool_t *pool) {
+  if (element == NULL) {
+    return;
+  }
+  if (reserve_put(pool, element, reserve_capacity(pool), 0U) != ESUCCESS) {
+    fatal("mempool: isr held more than min_nr elements\n");
+  }
+}
+
+/**
+ * @brief refill current cpu reserve of every pool, called from idle loop
+ * list lock is only tried so idle cpu never spins on it to start, pool is
+ * pinned and list lock dropped while allocator runs since it may reclaim
+ */
+void mempool_refill_idle_work(void) {
+  if (try_spinlock_acquire(&mempool_list_lock) != ESUCCESS) {
+    return;
+  }
+  mempool_t *pool = mempool_list;
+  while (pool != NULL) {
+    pool->refs++;
+    spinlock_release(&mempool_list_lock);
+    uint8_t ret = mempool_refill_local(pool);
+    spinlock_acquire(&mempool_list_lock);
+    pool->refs--;
+
+    /*pool destroyed meanwhile, last refill on it frees it*/
+    if (pool->next == NULL) {
+      uint8_t unpinned = (pool->refs == 0U);
+      spinlock_release(&mempool_list_lock);
+      if (unpinned) {
+        mempool_free_pool(pool);
+      }
+      return; /*walk goes on from the list head next round*/
+    }
+    if (ret != ESUCCESS) {
+      break; /*memory is short, try again on next round*/
+    }
+    pool = pool->next;
+    if (pool == mempool_list) {
+      break;
+    }
+  }
+  spinlock_release(&mempool_list_lock);
+}
+
+/**
+ * @brief get occupancy stats of a pool
+ * counters of other cpus are read without stopping them, so they are only a
+ * snapshot
+ */
+void mempool_get_stats(mempool_t *pool, mempool_stats_t *stats) {
+  memset(stats, 0x0, sizeof(mempool_stats_t));
+  stats->min_nr = pool->min_nr;
+  stats->low_nr = pool->min_nr;
+  for (uint8_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+    mempool_cpu_t *reserve = &pool->cpu[cpu];
+    stats->nr_alloc += reserve->nr_alloc;
+    stats->nr_reserve += reserve->nr_reserve;
+    stats->nr_fail += reserve->nr_fail;
+    stats->nr_refill += reserve->nr_refill;
+    stats->curr_nr += reserve->curr_nr;
+    if (reserve->low_nr < stats->low_nr) {
+      stats->low_nr = reserve->low_nr;
+    }
+  }
+}
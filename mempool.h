@@ -0,0 +1,138 @@
+#ifndef __MEMPOOL_H__
+#define __MEMPOOL_H__
+
+#include "board.h"
+#include "mm.h"
+#include "slab.h"
+#include <stdint.h>
+
+/**
+ * @brief callbacks which take elements from and give them back to the
+ * allocator under a pool
+ * alloc gets ALLOC_* flags, ALLOC_ATOMIC when it should not wait
+ */
+typedef void *(*mempool_alloc_t)(void *pool_data, uint32_t flags);
+typedef void (*mempool_free_t)(void *element, void *pool_data);
+
+/**
+ * @brief reserve of a pool on one cpu
+ * only touched by its cpu with irq disabled, so isr and thread never race
+ * on it and no lock is needed
+ * it has room for 2 * min_nr elements, slots over min_nr take elements put
+ * back from isr and are trimmed from idle loop
+ */
+typedef struct mempool_cpu {
+  void **elements;     /*reserved elements, LIFO*/
+  uint32_t curr_nr;    /*no of elements in reserve*/
+  uint32_t low_nr;     /*lowest curr_nr seen*/
+  uint64_t nr_alloc;   /*allocations served*/
+  uint64_t nr_reserve; /*allocations served from the reserve*/
+  uint64_t nr_fail;    /*allocations failed*/
+  uint64_t nr_refill;  /*elements put back into reserve by refill*/
+  uint8_t padding[CACHE_LINE_SIZE - sizeof(void **) - (2U * sizeof(uint32_t)) -
+                  (4U * sizeof(uint64_t))];
+} __attribute__((aligned(CACHE_LINE_SIZE))) mempool_cpu_t;
+
+/**
+ * @brief pool which keeps min_nr elements reserved on every cpu
+ * ALLOC_ATOMIC allocation (ex: isr) only takes from the reserve so it is
+ * bounded and succeeds as long as reserve is sized for the burst, reserve is
+ * refilled from idle loop of every cpu
+ */
+typedef struct mempool {
+  struct mempool *next; /*pools refilled from idle loop*/
+  struct mempool *prev;
+  mempool_alloc_t alloc;
+  mempool_free_t free;
+  void *pool_data;
+  uint32_t min_nr; /*no of elements reserved per cpu*/
+  uint32_t refs;   /*idle refills running on the pool, under list lock*/
+  uint8_t padding[CACHE_LINE_SIZE - (5U * sizeof(void *)) -
+                  (2U * sizeof(uint32_t))];
+  mempool_cpu_t cpu[MAX_CPUS];
+} mempool_t;
+
+/**
+ * @brief occupancy of a pool summed over all cpus
+ *
+ */
+typedef struct mempool_stats {
+  uint64_t nr_alloc;   /*allocations served*/
+  uint64_t nr_reserve; /*allocations served from the reserve*/
+  uint64_t nr_fail;    /*allocations failed*/
+  uint64_t nr_refill;  /*elements put back into reserve by refill*/
+  uint32_t min_nr;     /*no of elements reserved per cpu*/
+  uint32_t curr_nr;    /*no of elements in reserve of all cpus*/
+  uint32_t low_nr;     /*lowest reserve level any cpu has reached*/
+  uint8_t padding[4];
+} mempool_stats_t;
+
+/**
+ * @brief create a pool and fill the reserve of every cpu
+ * should be called from thread context
+ * @param min_nr no of elements reserved per cpu
+ * @param alloc takes an element from the allocator
+ * @param free gives an element back to the allocator
+ * @param pool_data passed to alloc and free
+ * @return pool or NULL if reserve can't be filled
+ */
+mempool_t *mempool_create(uint32_t min_nr, mempool_alloc_t alloc,
+                          mempool_free_t free, void *pool_data);
+
+/**
+ * @brief create a pool of objects of a slab cache
+ *
+ */
+mempool_t *mempool_create_slab_pool(uint32_t min_nr, kmem_cache_t *cache);
+
+/**
+ * @brief create a pool of blocks of 2^(order) pages, elements are page_t *
+ *
+ */
+mempool_t *mempool_create_page_pool(uint32_t min_nr, uint8_t order);
+
+/**
+ * @brief give every reserved element back and free the pool
+ * all elements taken from the pool should be freed before it, if an idle
+ * refill is running on the pool it is freed by that refill once done
+ */
+void mempool_destroy(mempool_t *pool);
+
+/**
+ * @brief allocate an element
+ * ALLOC_ATOMIC takes from current cpu reserve only, else allocator is tried
+ * first and reserve is used when it fails
+ * @return element or NULL
+ */
+void *mempool_alloc(mempool_t *pool, uint32_t flags);
+
+/**
+ * @brief free an element, it goes to current cpu reserve if that is short
+ * else back to the allocator
+ * allocator takes locks which turn irq on when released, so it should only
+ * be called from thread context
+ */
+void mempool_free(void *element, mempool_t *pool);
+
+/**
+ * @brief put back an element from isr, it only goes to current cpu reserve
+ * with irq disabled and never touches the allocator or any lock
+ * isr should put back elements on the cpu which took them with
+ * ALLOC_ATOMIC and hold at most min_nr of them at once, so reserve always
+ * has room for them
+ */
+void mempool_free_atomic(void *element, mempool_t *pool);
+
+/**
+ * @brief trim and refill current cpu reserve of every pool to min_nr,
+ * called from idle loop
+ */
+void mempool_refill_idle_work(void);
+
+/**
+ * @brief get occupancy stats of a pool
+ *
+ */
+void mempool_get_stats(mempool_t *pool, mempool_stats_t *stats);
+
+#endif
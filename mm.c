@@ -1,7 +1,10 @@
 #include "mm.h"
+#include "arena.h"
 #include "assert.h"
 #include "board.h"
 #include "buddy_alloc.h"
+#include "cma.h"
+#include "errno.h"
 #include "slab.h"
 #include "util.h"
 /**
@@ -12,74 +15,113 @@
 extern uint64_t heap_start;
 
 /**
- * @brief this will define the zone heap start after we allocate the memory we
- * needed for pre intialisation structures should it be from the zone itself? I
- * don't think that is necessary since kernel can access any page
+ * @brief fixed arena over heap zone memory, structures needed before buddy
+ * allocator exists (bitmaps, struct pages) are carved from it and zone heap
+ * starts after them
  *
  */
-static uint64_t pre_init_heap_addr;
+static arena_t boot_arena;
 
 static zone_t zones[ZONES_COUNT];
-static uint64_t struct_pages_list_start;
 
 /**
- * @brief alloc memory for bitmap inside FreeArea_t struct per order per zone
- * bitmap will represent whole memory bitmap for that zone contiguous memory
- * it doesn't depend on how much memory can be allocated by buddy allocator at
- * once contiguously
+ * @brief carve boot memory, there is nothing to fall back on if it runs out
  *
  */
-static void pre_alloc_bitmap_per_freearea_struct(zone_t *zone) {
+static void *boot_alloc(uint64_t size) {
+  void *ptr = arena_alloc(&boot_arena, size, sizeof(uint64_t));
+  if (ptr == NULL) {
+    fatal("boot arena is out of memory\n");
+  }
+  return ptr;
+}
+
+#define NR_MEM_SECTIONS (RAM_SIZE >> SECTION_SIZE_BITS)
+#define PFN_SECTION_SHIFT (SECTION_SIZE_BITS - _get_p2(PAGE_SIZE))
+#define PAGES_PER_SECTION BIT(PFN_SECTION_SHIFT)
+
+/**
+ * @brief struct page array per memory section, NULL for sections which are
+ * never handed to the buddy allocator
+ *
+ */
+static page_t *mem_section[NR_MEM_SECTIONS];
+
+/**
+ * @brief alloc memory for buddy bitmap of the zone
+ * bitmap only covers the zone range, from its first max order block till
+ * zone end, pair bits of all orders of a max order block are kept together
+ *
+ */
+static void pre_alloc_bitmap_zone(zone_t *zone) {
   if (!zone->allocatable) {
     // not allocatable why to waste memory
     return;
   }
 
-  /*calculate total bitmap size requirement
-  this is independent of zone it is for whole available memory*/
-  uint64_t total_bitmap_size = 0;
-  for (uint8_t order = 0; order < MAX_ORDER; order++) {
-    // np = (total_pages/(1<<order))/2
-    // total bits = ((np + bit_in_uint64 -1)/bit_int_uint64) * sizeof(uint64_t)
-    uint64_t bitmap_size =
-        (((((get_total_pages() / BIT(order)) / 2) + BITS_PER_UINT64 - 1) /
-          BITS_PER_UINT64) *
-         sizeof(uint64_t));
-    /*set the bitmap addr in freearea order*/
-    zone->area[order].bitmap =
-        (uint64_t *)(pre_init_heap_addr + total_bitmap_size);
-    total_bitmap_size += bitmap_size;
-    memset(zone->area[order].bitmap, 0x0,
-           bitmap_size); /*clean it to show that no block pair is available at
-                            that bit*/
-  }
-  pre_init_heap_addr += total_bitmap_size; /*update pre_init_heap address*/
+  /*zone start will only move forward after this, so bitmap sized now still
+  covers the zone*/
+  uint64_t group_size = BITMAP_GROUP_BITS * get_page_size();
+  uint64_t base = _aligntill(zone->start_addr, group_size);
+  uint64_t ngroups = (zone->start_addr + zone->size - base + group_size - 1U) /
+                     group_size;
+  uint64_t total_bitmap_size = ngroups * (BITMAP_GROUP_BITS / 8U);
+
+  zone->bitmap_base_pfn = get_page_indx(base);
+  zone->bitmap = (uint64_t *)boot_alloc(total_bitmap_size);
+  memset(zone->bitmap, 0x0,
+         total_bitmap_size); /*clean it to show that no block pair is
+                                available at that bit*/
 
   printk_debug("Total bitmap size required for zone:%d = %u\n", zone->zone_id,
                total_bitmap_size);
 }
 
 /**
- * @brief allocate memory for struct page for whole memory total pages
+ * @brief allocate memory for struct page only for the sections which overlap
+ * an allocatable zone, rest of the sections (ex: kernel image) get none
  *
  */
 static void pre_alloc_pages_struct(void) {
   // alignment check already taken care in structure intialisation
   // make sure to check for alignment warning -Wpadded
-  uint64_t total_size = sizeof(page_t) * get_total_pages();
-  struct_pages_list_start = pre_init_heap_addr;
-  pre_init_heap_addr += total_size;
+  uint64_t section_memmap_size = sizeof(page_t) * PAGES_PER_SECTION;
+  uint64_t total_size = 0;
+
+  for (uint8_t idx = 0; idx < ZONES_COUNT; idx++) {
+    zone_t *zone = &zones[idx];
+    if (!zone->allocatable || (zone->size == 0U)) {
+      continue;
+    }
+    uint64_t first = (zone->start_addr - RAM_START) >> SECTION_SIZE_BITS;
+    uint64_t last =
+        ((zone->start_addr + zone->size - 1U) - RAM_START) >> SECTION_SIZE_BITS;
+    for (uint64_t section = first; section <= last; section++) {
+      if (mem_section[section] != NULL) {
+        continue; /*shared with previous zone*/
+      }
+      mem_section[section] = (page_t *)boot_alloc(section_memmap_size);
+      total_size += section_memmap_size;
+    }
+  }
+
+  printk_debug("Total struct page size required = %u\n", total_size);
 }
 
 /**
- * @brief get struct page from the page list
+ * @brief get struct page from the sparse memmap
  * based on index
  * @param index of the page
+ * @return NULL if the page lies in a section without memmap
  */
 page_t *get_page_struct(uint64_t index) {
-  // typecast the pages_list start to struct page and increment by index and
-  // then return the typcasted address
-  return (page_t *)((page_t *)(struct_pages_list_start) + index);
+  uint64_t ram_index = index - get_page_indx(RAM_START);
+  uint64_t section = ram_index >> PFN_SECTION_SHIFT;
+  if ((index < get_page_indx(RAM_START)) || (section >= NR_MEM_SECTIONS) ||
+      (mem_section[section] == NULL)) {
+    return NULL;
+  }
+  return &mem_section[section][ram_index & (PAGES_PER_SECTION - 1U)];
 }
 
 /**
@@ -99,6 +141,14 @@ uint64_t get_page_indx(uint64_t addr) {
   return (addr >> _get_p2(get_page_size()));
 }
 
+/**
+ * @brief return start address of the page
+ *
+ */
+uint64_t get_page_addr(page_t *page) {
+  return ((uint64_t)page->pfn << _get_p2(get_page_size()));
+}
+
 /**
  * @brief function to get page size for the system
  *
@@ -129,6 +179,8 @@ static void zone_init(void) {
       ((uint64_t)&heap_start - zones[ZONE_NOHEAP].start_addr);
   memset(&zones[ZONE_NOHEAP].area, 0x0,
          sizeof(FreeArea_t) * MAX_ORDER); /*clean up FreaArea struct memory*/
+  zones[ZONE_NOHEAP].free_area_mask = 0U; /*no free blocks*/
+  spinlock_init(&zones[ZONE_NOHEAP].lock);
 
   // TODO: need to split zones in high and low heap (maybe like user and kernel
   // as well ?)!!!
@@ -136,12 +188,27 @@ static void zone_init(void) {
   zones[ZONE_HEAP].allocatable = 1U; /*YESSSS*/
   zones[ZONE_HEAP].zone_id = ZONE_HEAP;
   zones[ZONE_HEAP].start_addr = (uint64_t)&heap_start;
-  zones[ZONE_HEAP].size =
-      get_total_memory_in_bytes() - zones[ZONE_HEAP].start_addr;
+  zones[ZONE_HEAP].size = (RAM_END - CMA_SIZE) - zones[ZONE_HEAP].start_addr;
   memset(&zones[ZONE_HEAP].area, 0x0,
          sizeof(FreeArea_t) * MAX_ORDER); /*clean up FreaArea struct memory*/
+  zones[ZONE_HEAP].free_area_mask = 0U; /*buddy_heap_init will fill it*/
+  spinlock_init(&zones[ZONE_HEAP].lock);
+  /*get memory for bitmap*/
+  pre_alloc_bitmap_zone(&zones[ZONE_HEAP]);
+
+  // zone cma
+  //  end of ram kept for contiguous ranges, only movable allocations can
+  //  borrow it meanwhile
+  zones[ZONE_CMA].allocatable = (CMA_SIZE != 0U);
+  zones[ZONE_CMA].zone_id = ZONE_CMA;
+  zones[ZONE_CMA].start_addr = RAM_END - CMA_SIZE;
+  zones[ZONE_CMA].size = CMA_SIZE;
+  memset(&zones[ZONE_CMA].area, 0x0,
+         sizeof(FreeArea_t) * MAX_ORDER); /*clean up FreaArea struct memory*/
+  zones[ZONE_CMA].free_area_mask = 0U; /*buddy_heap_init will fill it*/
+  spinlock_init(&zones[ZONE_CMA].lock);
   /*get memory for bitmap*/
-  pre_alloc_bitmap_per_freearea_struct(&zones[ZONE_HEAP]);
+  pre_alloc_bitmap_zone(&zones[ZONE_CMA]);
 
   // print zone information
   for (uint8_t idx = 0; idx < ZONES_COUNT; idx++) {
@@ -163,6 +230,19 @@ zone_t *get_zone_info(uint8_t index) {
   return &zones[index];
 }
 
+/**
+ * @brief order of the buddy block kmalloc takes for a large size
+ * size is rounded to ceiling power of 2 and then to a page
+ */
+static uint8_t kmalloc_order(size_t size) {
+  /*align to ceiling power of 2*/
+  size = _alignup_2(size, _get_p2(size));
+  /*need to align the size to nearest page*/
+  size_t aligned_size = _alignto(size, get_page_size());
+  return (uint8_t)(__builtin_ctzl(aligned_size) -
+                   __builtin_ctzl(get_page_size())); /*trailing zeros*/
+}
+
 /**
  * @brief function to alloc memory
  * kmalloc: based on size it will decide from where to take the memory
@@ -178,43 +258,82 @@ void *kmalloc(size_t size) {
     return NULL;
   }
 
-  /*minimum size is 32 bytes*/
+  /*minimum size is 8 bytes*/
   if (size < MIN_ALLOC_SIZE_IN_BYTES) {
     size = MIN_ALLOC_SIZE_IN_BYTES;
   }
 
-  /*align to ceiling power of 2*/
-  size = _alignup_2(size, _get_p2(size));
+  if (size <= KMALLOC_MAX_CLASS_SIZE) {
+    // need to go with slab allocator, size class is picked there
+    return kmem_cache_alloc(size);
+  }
 
-  if (size >= get_page_size()) {
-    // going to use buddy allocator
-    /*need to align the size to nearest page*/
-    size_t aligned_size = _alignto(size, get_page_size());
-    uint8_t order =
-        __builtin_ctz(aligned_size) -
-        __builtin_ctz(get_page_size()); /*trailing zeros == powerof2*/
-    page_t *page = get_free_pages(order);
-    return (void *)page->start_addr;
-  } else {
-    // need to go with slab allocator
-    /*need to align to 4bytes*/
-    size_t aligned_size = _alignto(size, sizeof(uint32_t));
-    return kmem_cache_alloc(aligned_size);
+  // going to use buddy allocator
+  uint8_t order = kmalloc_order(size);
+  if (order >= MAX_ORDER) {
+    /*bigger than buddy can give, needs a contiguous range*/
+    size_t aligned_size = get_page_size() << order;
+    page_t *page = cma_alloc(aligned_size / get_page_size());
+    return (page != NULL) ? (void *)get_page_addr(page) : NULL;
   }
+  page_t *page = get_free_pages(order);
+  return (page != NULL) ? (void *)get_page_addr(page) : NULL;
 }
 
 /**
- * @brief kmalloc_aligned to alloc memory align to alignment
+ * @brief function to alloc zeroed memory
  *
  */
+void *kzalloc(size_t size) {
+  /*exactly one page, take an already zeroed one*/
+  if ((size > KMALLOC_MAX_CLASS_SIZE) && (size <= get_page_size())) {
+    page_t *page = alloc_pages(0, ALLOC_ZERO);
+    return (page != NULL) ? (void *)get_page_addr(page) : NULL;
+  }
+
+  void *ptr = kmalloc(size);
+  if (ptr != NULL) {
+    memset(ptr, 0x0, size);
+  }
+  return ptr;
+}
+
+/**
+ * @brief kmalloc_aligned to alloc memory align to alignment
+ * small objects come from size class caches whose objects are all aligned,
+ * bigger ones from a buddy block split out of a block of alignment size, so
+ * size is never rounded up to the alignment itself
+ * memory is freed with kfree
+ */
 void *kmalloc_aligned(size_t size, size_t alignment) {
-  /*if size if more than alignment than address will aligned*/
-  if (size >= alignment) {
+  if ((size == 0U) || !_is_power_of_two(alignment)) {
+    return NULL;
+  }
+  if (alignment <= MIN_ALLOC_SIZE_IN_BYTES) {
+    return kmalloc(size);
+  }
+
+  size_t aligned_size = _alignto(size, alignment);
+  if (aligned_size <= KMALLOC_MAX_CLASS_SIZE) {
+    return kmem_cache_alloc_aligned(size, alignment);
+  }
+
+  /*buddy blocks are aligned to their size, page alignment is free*/
+  uint8_t order = kmalloc_order(size);
+  uint8_t align_order = 0U;
+  if (alignment > get_page_size()) {
+    align_order = (uint8_t)(_get_p2(alignment) - _get_p2(get_page_size()));
+  }
+  if (align_order >= MAX_ORDER) {
+    /*nothing is aligned beyond max order block*/
+    return NULL;
+  }
+  if (order >= MAX_ORDER) {
+    /*cma ranges are made of whole max order blocks*/
     return kmalloc(size);
-  } else {
-    /*need to allocate memory upto alignment*/
-    return kmalloc(alignment);
   }
+  page_t *page = alloc_pages_aligned(order, align_order, 0U);
+  return (page != NULL) ? (void *)get_page_addr(page) : NULL;
 }
 
 /**
@@ -225,35 +344,113 @@ void *kmalloc_aligned(size_t size, size_t alignment) {
  */
 void kfree(void *ptr) {
   page_t *page = get_page_struct(get_page_indx((uint64_t)ptr));
+  if (page == NULL) {
+    // not from heap, ignore
+    return;
+  }
   if (page->page_owner == OWNER_BUDDY) {
-    // page is owned by buddy allocator
-    get_free_pages(page->order);
+    // page is owned by buddy allocator, order was recorded at alloc
+    free_pages(page, page->order);
   } else if (page->page_owner == OWNER_SLAB) {
-    assert(page->owner_kmem_cache_addr !=
+    assert(page->owner_slab !=
            NULL); /*only slab_alloc should set this then how come?*/
     // page is owned by slab allocator and by which cache
     kmem_cache_free(ptr, page);
+  } else if (page->page_owner == OWNER_CMA) {
+    // page is first page of a contiguous range
+    cma_free(page);
   } else {
     // ignore
   }
 }
 
+/**
+ * @brief copy the old contents of a reallocated object
+ * page aligned buddy/cma blocks are copied a page at a time
+ */
+static void krealloc_copy(void *dst, void *src, size_t size) {
+  uint64_t page_size = get_page_size();
+  if (_is_align((uint64_t)dst, page_size) &&
+      _is_align((uint64_t)src, page_size) && _is_align(size, page_size)) {
+    for (size_t off = 0U; off < size; off += page_size) {
+      copy_page((uint8_t *)dst + off, (uint8_t *)src + off);
+    }
+    return;
+  }
+  memcpy(dst, src, (unsigned int)size);
+}
+
+/**
+ * @brief function to resize memory from kmalloc
+ * krealloc: size of the old object is known from its struct page, so it is
+ * returned as it is if the new size still fits, buddy blocks try to grow in
+ * place by taking their free buddies, else a new object is taken, old
+ * contents are copied and old object is freed
+ * @return resized object, NULL on failure (old object is left untouched)
+ */
+void *krealloc(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return kmalloc(size);
+  }
+  if (size == 0U) {
+    kfree(ptr);
+    return NULL;
+  }
+
+  page_t *page = get_page_struct(get_page_indx((uint64_t)ptr));
+  if (page == NULL) {
+    // not from heap
+    return NULL;
+  }
+
+  size_t old_size = 0U;
+  if (page->page_owner == OWNER_SLAB) {
+    old_size = page->owner_slab->cache->objsize;
+  } else if (page->page_owner == OWNER_BUDDY) {
+    old_size = get_page_size() << page->order;
+    if ((size > old_size) && (size > KMALLOC_MAX_CLASS_SIZE)) {
+      uint8_t order = kmalloc_order(size);
+      if ((order < MAX_ORDER) &&
+          (buddy_extend_block(page, order) == ESUCCESS)) {
+        return ptr;
+      }
+    }
+  } else if (page->page_owner == OWNER_CMA) {
+    old_size = page->nr_pages * get_page_size();
+  } else {
+    return NULL;
+  }
+
+  if (size <= old_size) {
+    return ptr;
+  }
+
+  void *new_ptr = kmalloc(size);
+  if (new_ptr == NULL) {
+    return NULL;
+  }
+  krealloc_copy(new_ptr, ptr, old_size);
+  kfree(ptr);
+  return new_ptr;
+}
+
 /**
  * @brief boot mem intialisation
  * necessary to allocate memory for structures use to manage memory
  *
  */
 void boot_mem_init(void) {
-  // initialise pre_init_heap_addr
-  pre_init_heap_addr = (uint64_t)&heap_start;
+  // boot arena covers heap zone, what is left of it goes to buddy
+  arena_init_fixed(&boot_arena, (void *)&heap_start,
+                   (RAM_END - CMA_SIZE) - (uint64_t)&heap_start);
 
   zone_init(); /*bitmap pre_alloc done inside here*/
   pre_alloc_pages_struct();
 
   // update the memory left in zone_heap from next page
-  zones[ZONE_HEAP].start_addr = _alignto(pre_init_heap_addr, get_page_size());
+  zones[ZONE_HEAP].start_addr = _alignto(boot_arena.cur, get_page_size());
   zones[ZONE_HEAP].size =
-      get_total_memory_in_bytes() - zones[ZONE_HEAP].start_addr;
+      zones[ZONE_CMA].start_addr - zones[ZONE_HEAP].start_addr;
   printk_debug("zone: %d allocatable:%d start:%x size:%x\n",
                zones[ZONE_HEAP].zone_id, zones[ZONE_HEAP].allocatable,
                zones[ZONE_HEAP].start_addr, zones[ZONE_HEAP].size);
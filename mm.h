@@ -1,6 +1,7 @@
 #ifndef __MM_H__
 #define __MM_H__
 
+#include "spinlock.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -10,17 +11,29 @@
  */
 #define MAX_ORDER 11
 
+/**
+ * @brief memmap is split in sections of 2^SECTION_SIZE_BITS bytes of ram
+ * struct pages are only carved for sections which overlap an allocatable zone
+ */
+#define SECTION_SIZE_BITS 27 /*128MB*/
+
 /**
  * @brief minimum size of allocation in bytes
  *
  */
-#define MIN_ALLOC_SIZE_IN_BYTES 32
+#define MIN_ALLOC_SIZE_IN_BYTES 8
 
 /**
  * @brief enum to define total zones
  *
  */
-typedef enum { ZONE_NOHEAP = 0, ZONE_HEAP, ZONES_COUNT } zone_enum_t;
+typedef enum {
+  ZONE_NOHEAP = 0,
+  ZONE_HEAP,
+  ZONE_CMA, /*reserved for contiguous ranges, lends blocks to movable
+               allocations while idle, keep it last*/
+  ZONES_COUNT
+} zone_enum_t;
 
 /**
  * @brief enum for page owner information
@@ -29,24 +42,53 @@ typedef enum { ZONE_NOHEAP = 0, ZONE_HEAP, ZONES_COUNT } zone_enum_t;
  * and if slab then what is the address for the kmem_cache
  * this will help in Kfree very quickly
  */
-typedef enum { OWNER_BUDDY = 0, OWNER_SLAB, OWNER_COUNT } page_owner_enum_t;
+typedef enum {
+  OWNER_BUDDY = 0,
+  OWNER_SLAB,
+  OWNER_MOVABLE, /*owner can move it to another block, see compaction.h*/
+  OWNER_CMA,     /*first page of a contiguous range from cma.h*/
+  OWNER_COUNT
+} page_owner_enum_t;
 
 /**
- * @brief structure to store per order information
+ * @brief page flags, only valid in first page of a block
  *
  */
+#define PG_BUDDY (1U << 0)    /*block is sitting in buddy freelists*/
+#define PG_ISOLATED (1U << 1) /*block is held by compaction*/
+
+/**
+ * @brief intrusive free list node placed at the start of every free block
+ * doubly linked so a buddy can be unlinked in O(1) while merging
+ */
 typedef struct freeblock {
-  struct freeblock *next; /*will store free blocks information*/
+  struct freeblock *next; /*next free block of same order*/
+  struct freeblock *prev; /*previous free block of same order*/
 } FreeBlock_t;
 
+/**
+ * @brief structure to store per order information
+ *
+ */
 typedef struct freearea {
   FreeBlock_t *freeblocks_list; /*will store list of free blocks*/
-  uint64_t *bitmap;
-  /*this bitmap is per pair of blocks if no block is allocated mask is 0;
-  if a block is allocated from the pair the buddy will stay in the free_list and
-  mask will be 1, but if second buddy also get allocated mask will get 0*/
+  uint64_t nr_free;             /*no of blocks in freeblocks_list*/
 } FreeArea_t;
 
+/**
+ * @brief zone free page watermarks
+ * below WMARK_MIN only ALLOC_ATOMIC allocations are served, below WMARK_LOW
+ * background reclaim is asked for and it shrinks till WMARK_HIGH
+ */
+typedef enum { WMARK_MIN = 0, WMARK_LOW, WMARK_HIGH, WMARK_COUNT } wmark_enum_t;
+
+/**
+ * @brief no of bits in zone bitmap per max order block, holds the pair bits
+ * of all the orders of that block (512 + 256 + ... + 1, last one is spare)
+ *
+ */
+#define BITMAP_GROUP_BITS (1UL << (MAX_ORDER - 1))
+
 /**
  * @brief zone struct to define attributes avialable per zone
  *
@@ -55,45 +97,77 @@ typedef struct zone {
   uint8_t zone_id;     /*zone_id will be one of zone_enum_t*/
   uint8_t allocatable; /*defines if we can use this zone for heap allocation or
                           it is readonly*/
-  uint8_t padding[6];
+  uint16_t free_area_mask; /*bit n set if area[n] has atleast one free block,
+                              lets alloc find the first big enough order with
+                              one ctz*/
+  uint8_t padding[4];
   uint64_t start_addr;        /*start addr for this contiguous memory zone*/
   size_t size;                /*max size of this contiguous memory*/
+  spinlock_t lock;            /*protects freelists, bitmap and order mask*/
+  uint64_t *bitmap;
+  /*this bitmap is per pair of blocks if no block is allocated mask is 0;
+  if a block is allocated from the pair the buddy will stay in the free_list and
+  mask will be 1, but if second buddy also get allocated mask will get 0
+  one group of BITMAP_GROUP_BITS per max order block of the zone*/
+  uint64_t bitmap_base_pfn;   /*pfn of first max order block of the zone*/
+  uint64_t _Atomic deferred_next; /*start of memory not yet handed to buddy
+                                     freelists, deferred init*/
+  uint64_t nr_free_pages; /*no of pages in freelists, under zone lock*/
+  uint64_t watermark[WMARK_COUNT]; /*in pages, see wmark_enum_t*/
   FreeArea_t area[MAX_ORDER]; /*FreeArea struct per order to store free pages
-                                 information and bitmap for those buddies*/
+                                 information*/
 } zone_t;
 
 /**
  * @brief struct page for per page information
  * size of page will always be PAGE_SIZE
+ * kept to 16 bytes so four of them share a cache line, page address is
+ * derived from pfn, use get_page_addr()
  */
 typedef struct page {
-  uint8_t order;   /*this is necessary because during buddy deallocation we need
-                      order information to find the buddy*/
-  uint8_t zone_id; /*helpful while deallocating buddies else need to loop in
-                      each zone to find where this address will land*/
-  uint8_t page_owner; /*should be an page_owner_enum_t*/
-  uint8_t padding[5]; /*will remove it later if need for something else*/
-  void *owner_kmem_cache_addr; /*store the kmem_cache struct address to quickly
-                                  find the cache which owns it*/
-  uint64_t start_addr;         /*page start address*/
+  uint32_t order : 4;      /*this is necessary because during buddy deallocation
+                              we need order information to find the buddy*/
+  uint32_t zone_id : 2;    /*helpful while deallocating buddies else need to
+                              loop in each zone to find where this address will
+                              land*/
+  uint32_t page_owner : 3; /*should be an page_owner_enum_t*/
+  uint32_t flags : 23;     /*page state PG_* flags*/
+  uint32_t pfn;            /*page frame number, address = pfn * PAGE_SIZE*/
+  union {
+    struct slab *owner_slab; /*slab which holds this page, every page of a
+                                multi page slab points to it, slab knows
+                                its cache*/
+    struct page *next; /*link to chain pages while nobody owns them*/
+    const struct movable_ops *mops; /*how to migrate an OWNER_MOVABLE page*/
+    uint64_t nr_pages;              /*size of an OWNER_CMA range*/
+  };
 } page_t;
 
 /**
  * @brief kmalloc_aligned to alloc memory align to alignment
- *
+ * size is not rounded up to alignment, ex: 24 bytes at 64 bytes alignment is
+ * a 64 byte slab object and 64KB at 2MB alignment is a 64KB buddy block
+ * @param alignment power of 2, at most the max order block size
+ * @return memory to be freed with kfree, NULL on failure
  */
 void *kmalloc_aligned(size_t size, size_t alignment);
 
 /**
  * @brief function to alloc memory
  * kmalloc: based on size it will decide from where to take the memory
- * if size > PAGE_SIZE buddy_alloc will be use
- * else kmem_cache_alloc will be use
+ * if size > KMALLOC_MAX_CLASS_SIZE buddy_alloc will be use
+ * else kmem_cache_alloc of its size class will be use
  * Metadata : will be calulated first by getting the pfn for the address then
  * get the struct page and then check for who owns that page based on which
  * it will be dealloc by buddy or slab
  */
 void *kmalloc(size_t size);
+/**
+ * @brief function to alloc zeroed memory
+ * single page requests are served from per cpu pool of pages zeroed by idle
+ * cpu, others are cleared here
+ */
+void *kzalloc(size_t size);
 /**
  * @brief function to free memory
  * Kfree: first we will try to get the pfn for that addr
@@ -101,6 +175,13 @@ void *kmalloc(size_t size);
  * then call appropritae slab or buddy free
  */
 void kfree(void *ptr);
+/**
+ * @brief function to resize memory from kmalloc
+ * object stays where it is when the new size fits in it or a buddy block can
+ * grow in place, else it is moved and old memory is freed
+ * @return resized object, NULL on failure with old object left untouched
+ */
+void *krealloc(void *ptr, size_t size);
 
 /**
  * @brief return page index from the address
@@ -108,15 +189,21 @@ void kfree(void *ptr);
  * every page in whole memory of the system has an index
  */
 uint64_t get_page_indx(uint64_t addr);
+/**
+ * @brief return start address of the page
+ *
+ */
+uint64_t get_page_addr(page_t *page);
 /**
  * @brief get zone information
  *
  */
 zone_t *get_zone_info(uint8_t index);
 /**
- * @brief get struct page from the page list
+ * @brief get struct page from the sparse memmap
  * based on index
  * @param index of the page
+ * @return NULL if the page lies in a section without memmap
  */
 page_t *get_page_struct(uint64_t index);
 /**
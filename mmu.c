@@ -0,0 +1,255 @@
+#include "mmu.h"
+#include "assert.h"
+#include "atomic.h"
+#include "printk.h"
+#include "util.h"
+
+/*sctlr_el1 bits*/
+#define SCTLR_M (1UL << 0)  /*stage 1 translation*/
+#define SCTLR_A (1UL << 1)  /*alignment check*/
+#define SCTLR_C (1UL << 2)  /*data cache*/
+#define SCTLR_I (1UL << 12) /*instruction cache*/
+#define SCTLR_WXN (1UL << 19) /*writable memory is execute never*/
+
+/*par_el1 fields after an address translation*/
+#define PAR_F (1UL << 0) /*translation aborted*/
+#define PAR_PA_MASK 0x0000fffffffff000UL
+
+/*tcr_el1 fields, only ttbr0 is walked*/
+#define TCR_T0SZ (64UL - MMU_VA_BITS)
+#define TCR_IRGN0_WBWA (1UL << 8)
+#define TCR_ORGN0_WBWA (1UL << 10)
+#define TCR_SH0_INNER (3UL << 12)
+#define TCR_TG0_4K (0UL << 14)
+#define TCR_EPD1 (1UL << 23)
+#define TCR_TG1_4K (2UL << 30)
+#define TCR_IPS_SHIFT 32U
+#define TCR_IPS_MAX 5UL /*48 bit, 52 bit needs FEAT_LPA*/
+
+/*block attributes*/
+#define MMU_DEVICE_BLOCK                                                       \
+  (MMU_DESC_BLOCK | MMU_DESC_ATTR(MMU_ATTR_DEVICE) | MMU_DESC_AF |             \
+   MMU_DESC_PXN | MMU_DESC_UXN)
+#define MMU_NORMAL_BLOCK                                                       \
+  (MMU_DESC_BLOCK | MMU_DESC_ATTR(MMU_ATTR_NORMAL) | MMU_DESC_AP_RW_EL1 |      \
+   MMU_DESC_SH_INNER | MMU_DESC_AF | MMU_DESC_UXN)
+
+/**
+ * @brief end of kernel text defined in linker, everything after it is
+ * mapped execute never
+ */
+extern uint64_t rodata_base;
+
+/**
+ * @brief memory mapped peripherals, mapped as device memory
+ *
+ */
+typedef struct mmu_region {
+  uint64_t start;
+  uint64_t size;
+} mmu_region_t;
+
+static const mmu_region_t mmu_device_regions[] = {
+    {GIC_BASE, GIC_SIZE},
+    {VIRT_UART_ADDR, VIRT_UART_SIZE},
+};
+
+/**
+ * @brief translation tables shared by all cpus, written only by primary cpu
+ * in mmu_init
+ */
+static uint64_t mmu_l1_table[MMU_ENTRIES_PER_TABLE]
+    __attribute__((aligned(PAGE_SIZE)));
+static uint64_t mmu_l2_tables[MMU_L2_TABLES][MMU_ENTRIES_PER_TABLE]
+    __attribute__((aligned(PAGE_SIZE)));
+static uint32_t mmu_l2_used;
+
+/**
+ * @brief register values for mmu_switch_on, written only by primary cpu in
+ * mmu_init before its mmu is on, so secondary cpus read it from memory
+ */
+mmu_regs_t mmu_regs;
+
+/**
+ * @brief get the level 2 table of the 1GB region of va, a new one is linked
+ * into level 1 table if region has none
+ */
+static uint64_t *mmu_get_l2_table(uint64_t va) {
+  uint64_t *entry = &mmu_l1_table[va / MMU_L1_BLOCK_SIZE];
+  if ((*entry & MMU_DESC_TABLE) == MMU_DESC_TABLE) {
+    return (uint64_t *)(*entry & MMU_DESC_ADDR_MASK);
+  }
+  /*regions needing level 2 are mapped before 1GB blocks*/
+  assert(*entry == 0U);
+  if (mmu_l2_used >= MMU_L2_TABLES) {
+    fatal("mmu: out of level 2 tables\n");
+  }
+  uint64_t *table = mmu_l2_tables[mmu_l2_used++];
+  *entry = (uint64_t)table | MMU_DESC_TABLE;
+  return table;
+}
+
+/**
+ * @brief identity map [start, end) with 2MB blocks, both 2MB aligned
+ *
+ */
+static void mmu_map_l2(uint64_t start, uint64_t end, uint64_t attrs) {
+  for (uint64_t addr = start; addr < end; addr += MMU_L2_BLOCK_SIZE) {
+    uint64_t *table = mmu_get_l2_table(addr);
+    table[(addr / MMU_L2_BLOCK_SIZE) % MMU_ENTRIES_PER_TABLE] = addr | attrs;
+  }
+}
+
+/**
+ * @brief identity map ram as normal memory
+ * 1GB regions fully inside ram and without kernel text are single level 1
+ * blocks, others are split in 2MB blocks so text can be executable alone
+ */
+static void mmu_map_ram(void) {
+  uint64_t text_start = KERNEL_ENTRY_ADDR;
+  uint64_t text_end = (uint64_t)&rodata_base;
+  uint64_t block_size = MMU_L2_BLOCK_SIZE;
+  text_start = _aligntill(text_start, block_size);
+  text_end = _alignto(text_end, block_size);
+  assert(_is_align(RAM_START, block_size) && _is_align(RAM_END, block_size));
+
+  uint64_t region_size = MMU_L1_BLOCK_SIZE;
+  uint64_t region = RAM_START;
+  region = _aligntill(region, region_size);
+  for (; region < RAM_END; region += MMU_L1_BLOCK_SIZE) {
+    uint64_t start = (region < RAM_START) ? RAM_START : region;
+    uint64_t end = region + MMU_L1_BLOCK_SIZE;
+    end = (end > RAM_END) ? RAM_END : end;
+    uint8_t has_text = (start < text_end) && (text_start < end);
+    if ((start == region) && (end == (region + MMU_L1_BLOCK_SIZE)) &&
+        !has_text && (mmu_l1_table[region / MMU_L1_BLOCK_SIZE] == 0U)) {
+      mmu_l1_table[region / MMU_L1_BLOCK_SIZE] =
+          region | MMU_NORMAL_BLOCK | MMU_DESC_PXN;
+      continue;
+    }
+    for (uint64_t addr = start; addr < end; addr += MMU_L2_BLOCK_SIZE) {
+      uint64_t attrs = MMU_NORMAL_BLOCK;
+      if ((addr < text_start) || (addr >= text_end)) {
+        attrs |= MMU_DESC_PXN;
+      }
+      mmu_map_l2(addr, addr + MMU_L2_BLOCK_SIZE, attrs);
+    }
+  }
+}
+
+/**
+ * @brief set contiguous hint on every aligned group of MMU_CONTIG_ENTRIES
+ * blocks which map adjacent memory with same attributes, tlb can then cache
+ * the whole group as one entry
+ */
+static void mmu_set_contig(uint64_t *table, uint64_t block_size) {
+  for (uint32_t first = 0; first < MMU_ENTRIES_PER_TABLE;
+       first += MMU_CONTIG_ENTRIES) {
+    uint64_t desc = table[first];
+    if ((desc & MMU_DESC_TABLE) != MMU_DESC_BLOCK) {
+      continue;
+    }
+    uint64_t group_size = block_size * MMU_CONTIG_ENTRIES;
+    uint64_t base = desc & MMU_DESC_ADDR_MASK;
+    if (!_is_align(base, group_size)) {
+      continue;
+    }
+    uint32_t idx = 1U;
+    while ((idx < MMU_CONTIG_ENTRIES) &&
+           (table[first + idx] == (desc + (idx * block_size)))) {
+      idx++;
+    }
+    if (idx < MMU_CONTIG_ENTRIES) {
+      continue;
+    }
+    for (idx = 0; idx < MMU_CONTIG_ENTRIES; idx++) {
+      table[first + idx] |= MMU_DESC_CONTIG;
+    }
+  }
+}
+
+/**
+ * @brief check that va translates to itself on current cpu
+ *
+ */
+static void mmu_check_identity(uint64_t va) {
+  uint64_t par;
+  __asm__ volatile("at s1e1r, %0" : : "r"(va));
+  instruction_barrier();
+  __asm__ volatile("mrs %0, PAR_EL1" : "=r"(par));
+  if ((par & PAR_F) || ((par & PAR_PA_MASK) != _aligntill(va, PAGE_SIZE))) {
+    fatal("mmu: identity map check failed\n");
+  }
+}
+
+/**
+ * @brief system register values which turn mmu and caches on, same for
+ * every cpu
+ * output address size is what the primary cpu supports, all cpus of the
+ * board are alike
+ */
+static void mmu_set_regs(void) {
+  uint64_t mmfr0;
+  __asm__ volatile("mrs %0, ID_AA64MMFR0_EL1" : "=r"(mmfr0));
+  uint64_t ips = mmfr0 & 0xfUL;
+  if (ips > TCR_IPS_MAX) {
+    ips = TCR_IPS_MAX;
+  }
+
+  mmu_regs.mair = MMU_MAIR_VALUE;
+  mmu_regs.tcr = TCR_T0SZ | TCR_IRGN0_WBWA | TCR_ORGN0_WBWA | TCR_SH0_INNER |
+                 TCR_TG0_4K | TCR_EPD1 | TCR_TG1_4K | (ips << TCR_IPS_SHIFT);
+  mmu_regs.ttbr0 = (uint64_t)mmu_l1_table;
+  mmu_regs.sctlr_set = SCTLR_M | SCTLR_C | SCTLR_I;
+  /*normal memory allows unaligned access, kernel text is writable so it
+   * would not be executable with wxn*/
+  mmu_regs.sctlr_clear = SCTLR_A | SCTLR_WXN;
+}
+
+/**
+ * @brief check that text, tables and uart are reachable at the same address
+ * on current cpu
+ */
+void mmu_check(void) {
+  mmu_check_identity((uint64_t)&mmu_check);
+  mmu_check_identity((uint64_t)mmu_l1_table);
+  mmu_check_identity(VIRT_UART_ADDR);
+}
+
+/**
+ * @brief build the identity map shared by all cpus and turn mmu on
+ * peripherals are mapped first since they need level 2 tables
+ */
+void mmu_init(void) {
+  memset(mmu_l1_table, 0x0, sizeof(mmu_l1_table));
+  memset(mmu_l2_tables, 0x0, sizeof(mmu_l2_tables));
+  mmu_l2_used = 0U;
+
+  uint64_t block_size = MMU_L2_BLOCK_SIZE;
+  for (uint32_t idx = 0;
+       idx < (sizeof(mmu_device_regions) / sizeof(mmu_device_regions[0]));
+       idx++) {
+    uint64_t start = mmu_device_regions[idx].start;
+    uint64_t end = start + mmu_device_regions[idx].size;
+    start = _aligntill(start, block_size);
+    end = _alignto(end, block_size);
+    mmu_map_l2(start, end, MMU_DEVICE_BLOCK);
+  }
+  mmu_map_ram();
+
+  mmu_set_contig(mmu_l1_table, MMU_L1_BLOCK_SIZE);
+  for (uint32_t idx = 0; idx < mmu_l2_used; idx++) {
+    mmu_set_contig(mmu_l2_tables[idx], MMU_L2_BLOCK_SIZE);
+  }
+  mmu_set_regs();
+  /*table walks and secondary cpus read memory, tables and registers should
+   * reach it before mmu is on*/
+  data_barrier();
+
+  /*stack written so far with mmu off is in memory and data cache comes out
+   * of reset invalid (not modelled by qemu), so nothing stale is read back
+   * once caches are on, other cpus are not running yet*/
+  mmu_switch_on(&mmu_regs);
+  mmu_check();
+  printk_info("mmu: identity map on, level 2 tables:%u\n", mmu_l2_used);
+}
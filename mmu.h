@@ -0,0 +1,93 @@
+#ifndef __MMU_H__
+#define __MMU_H__
+
+#include "board.h"
+#include <stdint.h>
+
+/**
+ * @brief translation regime: 4KB granule, 39 bit virtual address so walks
+ * start at level 1, level 1 entry maps 1GB and level 2 entry maps 2MB
+ */
+#define MMU_VA_BITS 39U
+#define MMU_ENTRIES_PER_TABLE 512U
+#define MMU_L1_BLOCK_SIZE 0x40000000UL /*1GB*/
+#define MMU_L2_BLOCK_SIZE 0x200000UL   /*2MB*/
+
+/**
+ * @brief no of level 2 tables, used where a 1GB region can't be one block
+ * (device regions and the region which has the kernel image)
+ */
+#define MMU_L2_TABLES 4U
+
+/**
+ * @brief no of adjacent entries covered by the contiguous hint at level 1
+ * and 2 with 4KB granule
+ */
+#define MMU_CONTIG_ENTRIES 16U
+
+/**
+ * @brief translation table descriptor bits
+ *
+ */
+#define MMU_DESC_BLOCK (1UL << 0)
+#define MMU_DESC_TABLE (3UL << 0)
+#define MMU_DESC_ATTR(idx) ((uint64_t)(idx) << 2)
+#define MMU_DESC_AP_RW_EL1 (0UL << 6)
+#define MMU_DESC_SH_INNER (3UL << 8)
+#define MMU_DESC_AF (1UL << 10)
+#define MMU_DESC_CONTIG (1UL << 52)
+#define MMU_DESC_PXN (1UL << 53)
+#define MMU_DESC_UXN (1UL << 54)
+#define MMU_DESC_ADDR_MASK 0x0000fffffffff000UL
+
+/**
+ * @brief memory attribute indexes into MAIR_EL1
+ * device is nGnRnE, normal is write back read/write allocate inner and outer
+ */
+#define MMU_ATTR_DEVICE 0U
+#define MMU_ATTR_NORMAL 1U
+#define MMU_MAIR_VALUE                                                         \
+  ((0x00UL << (8U * MMU_ATTR_DEVICE)) | (0xffUL << (8U * MMU_ATTR_NORMAL)))
+
+/**
+ * @brief system register values which turn mmu and caches on
+ * boot.S reads it with mmu off, offsets should match the loads there
+ */
+typedef struct mmu_regs {
+  uint64_t mair;        /*MAIR_EL1*/
+  uint64_t tcr;         /*TCR_EL1*/
+  uint64_t ttbr0;       /*TTBR0_EL1, level 1 table*/
+  uint64_t sctlr_set;   /*SCTLR_EL1 bits to set*/
+  uint64_t sctlr_clear; /*SCTLR_EL1 bits to clear*/
+} mmu_regs_t;
+
+/**
+ * @brief registers of the identity map, filled by mmu_init
+ *
+ */
+extern mmu_regs_t mmu_regs;
+
+/**
+ * @brief build the identity map shared by all cpus and turn mmu and caches
+ * on for the primary cpu
+ * ram is normal cacheable memory, kernel text is the only executable part,
+ * gic and uart are device memory, should be called before boot_mem_init and
+ * before secondary cpus are started
+ */
+void mmu_init(void);
+
+/**
+ * @brief turn mmu and caches on for current cpu, defined in boot.S
+ * tlb and instruction cache are invalidated first, it doesn't use the stack
+ * so secondary cpus call it before they have one
+ * @param regs register values built by mmu_init
+ */
+void mmu_switch_on(mmu_regs_t *regs);
+
+/**
+ * @brief check that current cpu sees the identity map, fatal if not
+ *
+ */
+void mmu_check(void);
+
+#endif
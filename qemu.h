@@ -6,6 +6,10 @@
 #define RAM_SIZE 0x100000000 /*4GB*/
 #define RAM_END (RAM_START + RAM_SIZE)
 
+/*Reserved at end of RAM for contiguous allocations bigger than max order,
+ * should be multiple of max order block size*/
+#define CMA_SIZE 0x10000000 /*256MB*/
+
 /*Kernel start*/
 #define KERNEL_ENTRY_ADDR RAM_START
 
@@ -17,11 +21,15 @@
 /* MAX CPU CORES*/
 #define MAX_CPUS 4
 
+/*Data cache line size in bytes (cortex-a/qemu max cpu)*/
+#define CACHE_LINE_SIZE 64
+
 /*LOG BUFFER SIZE in bytes*/
 #define LOG_BUFF_SIZE 2048
 
 /*For Qemu Virt Aarch64 Arm SOC*/
 #define VIRT_UART_ADDR 0x09000000
+#define VIRT_UART_SIZE 0x1000
 
 /*
  * GIC on QEMU Virt
@@ -39,6 +47,8 @@
 #define GIC_BASE (QEMU_VIRT_GIC_BASE)
 #define GIC_DIST (GIC_BASE)
 #define GIC_REDIST (0x080A0000)
+/*distributor and redistributors of all cpus*/
+#define GIC_SIZE (0x00200000)
 #define GIC_INT_MAX (QEMU_VIRT_GIC_INT_MAX)
 #define GIC_PRIO_MAX (QEMU_VIRT_GIC_PRIO_MAX)
 #define GIC_INTNO_SGI0 (QEMU_VIRT_GIC_INTNO_SGIO)
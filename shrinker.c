@@ -0,0 +1,105 @@
+#include "shrinker.h"
+#include "atomic.h"
+#include "buddy_alloc.h"
+#include "errno.h"
+#include "mm.h"
+#include "spinlock.h"
+
+/**
+ * @brief registered shrinkers, NULL slots are free
+ * callbacks are never called with registry_lock held since they take cache
+ * and zone locks themselves
+ */
+static const shrinker_t *shrinkers[MAX_SHRINKERS];
+static DECALRE_SPINLOCK(registry_lock);
+
+/**
+ * @brief set when a zone dropped below its low watermark
+ *
+ */
+static _Atomic uint8_t reclaim_wanted = 0U;
+
+/**
+ * @brief add a shrinker to the registry
+ *
+ */
+uint8_t register_shrinker(const shrinker_t *shrinker) {
+  uint8_t ret = EBUSY;
+
+  if ((shrinker == NULL) || (shrinker->count == NULL) ||
+      (shrinker->scan == NULL)) {
+    return EINVALID;
+  }
+
+  spinlock_acquire(&registry_lock);
+  for (uint8_t idx = 0; idx < MAX_SHRINKERS; idx++) {
+    if (shrinkers[idx] == NULL) {
+      shrinkers[idx] = shrinker;
+      ret = ESUCCESS;
+      break;
+    }
+  }
+  spinlock_release(&registry_lock);
+  return ret;
+}
+
+/**
+ * @brief remove a shrinker from the registry
+ *
+ */
+void unregister_shrinker(const shrinker_t *shrinker) {
+  spinlock_acquire(&registry_lock);
+  for (uint8_t idx = 0; idx < MAX_SHRINKERS; idx++) {
+    if (shrinkers[idx] == shrinker) {
+      shrinkers[idx] = NULL;
+    }
+  }
+  spinlock_release(&registry_lock);
+}
+
+/**
+ * @brief call registered shrinkers till nr_pages pages are freed
+ * registry is copied under the lock and shrinkers are called after dropping
+ * it, shrinkers with nothing to give are skipped
+ */
+uint64_t shrink_memory(uint64_t nr_pages) {
+  const shrinker_t *snapshot[MAX_SHRINKERS];
+  uint64_t freed = 0;
+
+  spinlock_acquire(&registry_lock);
+  for (uint8_t idx = 0; idx < MAX_SHRINKERS; idx++) {
+    snapshot[idx] = shrinkers[idx];
+  }
+  spinlock_release(&registry_lock);
+
+  for (uint8_t idx = 0; (idx < MAX_SHRINKERS) && (freed < nr_pages); idx++) {
+    const shrinker_t *shrinker = snapshot[idx];
+    if ((shrinker == NULL) || (shrinker->count() == 0U)) {
+      continue;
+    }
+    freed += shrinker->scan(nr_pages - freed);
+  }
+  return freed;
+}
+
+/**
+ * @brief ask for background reclaim
+ *
+ */
+void wakeup_reclaim(void) { atomic_store_relaxed(&reclaim_wanted, 1U); }
+
+/**
+ * @brief background reclaim, called from idle loop of every cpu
+ * free page counters are read without zone lock, it is only a hint
+ */
+void reclaim_idle_work(void) {
+  if (!atomic_exchange_explicit(&reclaim_wanted, 0U, memory_order_relaxed)) {
+    return;
+  }
+
+  /*cma zone is not counted, shrinkers can't give pages back to it*/
+  uint64_t wanted = buddy_reclaim_deficit();
+  if (wanted != 0U) {
+    shrink_memory(wanted);
+  }
+}
@@ -0,0 +1,62 @@
+#ifndef __SHRINKER_H__
+#define __SHRINKER_H__
+
+#include <stdint.h>
+
+/**
+ * @brief max no of shrinkers which can be registered at once
+ *
+ */
+#define MAX_SHRINKERS 8U
+
+/**
+ * @brief no of pages direct reclaim tries to free for a failed allocation
+ * at least, so the next few allocations don't need to reclaim again
+ */
+#define SHRINK_BATCH 32U
+
+/**
+ * @brief callbacks of a cache which can give memory back under pressure
+ * both are called without any allocator lock held, they should not allocate
+ */
+typedef struct shrinker {
+  /*no of pages which can be freed right now, only a hint*/
+  uint64_t (*count)(void);
+  /*free upto nr_pages pages, return no of pages freed*/
+  uint64_t (*scan)(uint64_t nr_pages);
+} shrinker_t;
+
+/**
+ * @brief add a shrinker to the registry
+ * @param shrinker should stay valid till it is unregistered
+ * @return ESUCCESS on success, EINVALID for missing callbacks, EBUSY if
+ * registry is full
+ */
+uint8_t register_shrinker(const shrinker_t *shrinker);
+
+/**
+ * @brief remove a shrinker from the registry
+ * a reclaim which already picked it up may still call it once
+ */
+void unregister_shrinker(const shrinker_t *shrinker);
+
+/**
+ * @brief call registered shrinkers till nr_pages pages are freed
+ * @param nr_pages no of pages wanted
+ * @return no of pages freed
+ */
+uint64_t shrink_memory(uint64_t nr_pages);
+
+/**
+ * @brief ask for background reclaim, called by buddy allocator when a zone
+ * drops below its low watermark
+ */
+void wakeup_reclaim(void);
+
+/**
+ * @brief background reclaim, called from idle loop of every cpu
+ * shrinks till every zone is back above its high watermark
+ */
+void reclaim_idle_work(void);
+
+#endif
@@ -1,7 +1,18 @@
 #include "slab.h"
+#include "aarch64.h"
 #include "assert.h"
+#include "errno.h"
+#include "psw.h"
+#include "shrinker.h"
+#include "timer.h"
+#include "util.h"
 
-extern page_t *get_free_page(void);
+extern page_t *get_free_pages(uint8_t order);
+extern void free_pages(page_t *page, uint8_t order);
+extern void free_pages_bulk(page_t **pages, uint64_t count, uint8_t order);
+
+/*no of released slab pages given back to buddy in one go*/
+#define SLAB_SHRINK_BATCH 16U
 
 /**
  * @brief macro to locate kmem_buf_ctl after slab
@@ -32,144 +43,749 @@ void initialize_kmem_buf_ctl(kmem_bufctl_t *bufctl, uint64_t array_size) {
 
 static kmem_cache_t cache_cache;
 static kmem_cache_t *global_cache_p = NULL;
+/**
+ * @brief cache which magazines are allocated from, magazines are always
+ * allocated and freed from its slabs directly so they never need a magazine
+ */
+static kmem_cache_t *magazine_cache = NULL;
+/**
+ * @brief protects the global circular cache list
+ * slab lists of a cache are protected by the cache own lock, slab pages are
+ * only given back with it held so holder can follow owner_slab of a page
+ */
+static DECALRE_SPINLOCK(cache_chain_lock);
+/**
+ * @brief last time reaper ran on a cpu
+ *
+ */
+static uint64_t last_reap_run[MAX_CPUS];
+
+/**
+ * @brief kmalloc size classes, spaced at about 1/2 and 3/4 steps between
+ * powers of 2 so the space wasted by rounding stays under a third
+ */
+static const uint16_t kmalloc_class_size[KMALLOC_CLASSES] = {
+    8,   16,  32,  48,  64,   96,   128,  192,
+    256, 384, 512, 768, 1024, 1536, 2048, 3072};
+
+/**
+ * @brief class of a size, indexed by (size - 1) / KMALLOC_CLASS_STEP
+ * filled at compile time so a lookup is a single load
+ */
+static const uint8_t kmalloc_class_index[KMALLOC_MAX_CLASS_SIZE /
+                                         KMALLOC_CLASS_STEP] = {
+    [0] = 0,            /*8*/
+    [1] = 1,            /*16*/
+    [2 ... 3] = 2,      /*32*/
+    [4 ... 5] = 3,      /*48*/
+    [6 ... 7] = 4,      /*64*/
+    [8 ... 11] = 5,     /*96*/
+    [12 ... 15] = 6,    /*128*/
+    [16 ... 23] = 7,    /*192*/
+    [24 ... 31] = 8,    /*256*/
+    [32 ... 47] = 9,    /*384*/
+    [48 ... 63] = 10,   /*512*/
+    [64 ... 95] = 11,   /*768*/
+    [96 ... 127] = 12,  /*1024*/
+    [128 ... 191] = 13, /*1536*/
+    [192 ... 255] = 14, /*2048*/
+    [256 ... 383] = 15, /*3072*/
+};
+
+/**
+ * @brief cache per size class, created at boot and never freed
+ *
+ */
+static kmem_cache_t *kmalloc_caches[KMALLOC_CLASSES];
+
+/**
+ * @brief size class caches for aligned objects, indexed by class and
+ * log2(align) - KMALLOC_MIN_ALIGN_SHIFT, created on first use
+ */
+static kmem_cache_t *kmalloc_aligned_caches[KMALLOC_CLASSES]
+                                           [KMALLOC_ALIGN_CLASSES];
+static DECALRE_SPINLOCK(kmalloc_aligned_lock);
+
+/**
+ * @brief size class cache of a size in [1, KMALLOC_MAX_CLASS_SIZE]
+ *
+ */
+static kmem_cache_t *kmalloc_cache_for(size_t size) {
+  return kmalloc_caches[kmalloc_class_index[(size - 1U) / KMALLOC_CLASS_STEP]];
+}
+
+static void *alloc_slab_mem(kmem_cache_t *cache);
+static void slab_free_objs(kmem_cache_t *cache, void **objs, uint64_t count);
+
+/**
+ * @brief bytes of bufctl array per object, free pointer mode has none
+ *
+ */
+static uint64_t slab_bufctl_size(kmem_cache_t *cache) {
+  return cache->freeptr ? 0U : sizeof(kmem_bufctl_t);
+}
+
+/**
+ * @brief no of objects in a slab of the cache
+ * objsize*x + 4*x = total_size
+ * so, x = total_size/(4+objsize)
+ * x = num of objects that can be allocated
+ * space for aligning smem is kept aside first, off slab has whole slab for
+ * objects
+ */
+static uint64_t slab_nr_objs(kmem_cache_t *cache, uint8_t order,
+                             uint8_t off_slab) {
+  uint64_t slab_size = get_page_size() << order;
+  if (off_slab) {
+    return slab_size / cache->objsize;
+  }
+  return (slab_size - sizeof(slab_t) -
+          (cache->align - sizeof(kmem_bufctl_t))) /
+         (cache->objsize + slab_bufctl_size(cache));
+}
+
+/**
+ * @brief size of slab descriptor with its bufctl array
+ *
+ */
+static uint64_t slab_desc_size(kmem_cache_t *cache) {
+  return sizeof(slab_t) + (cache->nr_objs * slab_bufctl_size(cache));
+}
+
+/**
+ * @brief free pointer stored in a free object
+ * with MM_SLAB_FREEPTR_OBFUSCATE it is xored with cache key and its own
+ * address, so a leaked or overwritten free object doesn't give a usable
+ * pointer, it is its own inverse so it also decodes
+ * @param slot address of the free object which holds it
+ */
+static uint64_t freeptr_code(kmem_cache_t *cache, uint64_t slot,
+                             uint64_t ptr) {
+#if MM_SLAB_FREEPTR_OBFUSCATE
+  return ptr ^ cache->freeptr_key ^ slot;
+#else
+  (void)cache;
+  (void)slot;
+  return ptr;
+#endif
+}
+
+/**
+ * @brief key to obfuscate free pointers of a cache
+ * no random source yet, boot time and cache address are mixed
+ */
+static uint64_t freeptr_new_key(kmem_cache_t *cache) {
+  uint64_t key = get_system_timestamp_ns() ^ (uint64_t)cache;
+  key *= 0x9E3779B97F4A7C15UL; /*golden ratio, spreads bits*/
+  return key ^ (key >> 29U);
+}
+
+/**
+ * @brief offset of first object from slab start before colouring
+ * slab starts at a block aligned to its size so it is same for every slab of
+ * the cache
+ */
+static uint64_t slab_smem_offset(kmem_cache_t *cache) {
+  if (cache->off_slab) {
+    return 0;
+  }
+  return _alignto(slab_desc_size(cache), cache->align);
+}
+
+/**
+ * @brief choose slab order and descriptor place of a cache
+ * - descriptor goes off slab if it would cost an object in the slab
+ * - smallest order which wastes at most 1/SLAB_WASTE_RATIO of the slab is
+ * taken, else the order with least waste
+ * @param allow_off_slab descriptor can be kept off slab
+ * @return ESUCCESS or EFAILURE if object doesn't fit any slab
+ */
+static uint8_t cache_init_layout(kmem_cache_t *cache, uint8_t allow_off_slab) {
+  uint64_t best_waste = UINT64_MAX;
+  uint64_t best_size = 1U;
+
+  /*off slab descriptors should be small class objects*/
+  allow_off_slab &= (cache->objsize >= SLAB_OFF_SLAB_MIN_SIZE);
+  cache->nr_objs = 0;
+  for (uint8_t order = 0; order <= SLAB_MAX_ORDER; order++) {
+    uint64_t slab_size = get_page_size() << order;
+    uint8_t off_slab = 0U;
+    uint64_t nr_objs = slab_nr_objs(cache, order, 0U);
+    if (allow_off_slab && (slab_nr_objs(cache, order, 1U) > nr_objs)) {
+      off_slab = 1U;
+      nr_objs = slab_nr_objs(cache, order, 1U);
+    }
+    if (nr_objs == 0U) {
+      continue;
+    }
+    /*compare waste / slab_size of both orders, bufctl is a cost of every
+     * object so it is not waste*/
+    uint64_t obj_cost =
+        cache->objsize + (off_slab ? 0U : slab_bufctl_size(cache));
+    uint64_t waste = slab_size - (nr_objs * obj_cost);
+    if ((waste * best_size) < (best_waste * slab_size)) {
+      best_waste = waste;
+      best_size = slab_size;
+      cache->order = order;
+      cache->off_slab = off_slab;
+      cache->nr_objs = (uint32_t)nr_objs;
+    }
+    if ((waste * SLAB_WASTE_RATIO) <= slab_size) {
+      break;
+    }
+  }
+  if (cache->nr_objs == 0U) {
+    return EFAILURE;
+  }
+  /*keep descriptor out of the off slab caches*/
+  assert(!cache->off_slab ||
+         (slab_desc_size(cache) < SLAB_OFF_SLAB_MIN_SIZE));
+  return ESUCCESS;
+}
+
+/**
+ * @brief setup colours of a cache
+ * space left at end of the slab after the objects is used to start every
+ * new slab objects at next colour offset, so same object of different slabs
+ * don't map to the same cache sets
+ */
+static void cache_init_colour(kmem_cache_t *cache) {
+  uint64_t slack = (get_page_size() << cache->order) -
+                   slab_smem_offset(cache) -
+                   (cache->nr_objs * cache->objsize);
+  /*colour step keeps object alignment and moves at least one cache line*/
+  cache->colour_off = cache->align;
+  if (cache->colour_off < CACHE_LINE_SIZE) {
+    cache->colour_off = CACHE_LINE_SIZE;
+  }
+  cache->colour = (uint32_t)(slack / cache->colour_off) + 1U;
+  cache->colour_next = 0;
+}
+
+/**
+ * @brief no of empty slabs reaper leaves to a cache
+ *
+ */
+static uint64_t cache_empty_limit(kmem_cache_t *cache) {
+  return (SLAB_REAP_KEEP_OBJS + cache->nr_objs - 1U) / cache->nr_objs;
+}
+
+/**
+ * @brief set owner of all pages of a slab
+ *
+ */
+static void slab_set_pages(page_t *page, uint8_t order, uint8_t owner,
+                           slab_t *slab) {
+  for (uint64_t idx = 0; idx < BIT(order); idx++) {
+    page[idx].page_owner = owner;
+    page[idx].owner_slab = slab;
+  }
+}
+
+/**
+ * @brief first page of a slab
+ * objects start within the slab block and block is aligned to its size
+ */
+static page_t *slab_first_page(kmem_cache_t *cache, slab_t *slab) {
+  uint64_t slab_size = (uint64_t)get_page_size() << cache->order;
+  uint64_t start = _aligntill(slab->smem, slab_size);
+  return get_page_struct(get_page_indx(start));
+}
+
+/**
+ * @brief take a slab away from cache pages, pages are then owned by caller
+ * called under cache chain lock and cache lock, off slab descriptor is freed
+ * later with slab_free_desc without cache lock
+ * @return first page of the slab
+ */
+static page_t *slab_release_pages(kmem_cache_t *cache, slab_t *slab) {
+  page_t *page = slab_first_page(cache, slab);
+  slab_set_pages(page, cache->order, OWNER_BUDDY, NULL);
+  return page;
+}
+
+/**
+ * @brief free off slab descriptor of a released slab
+ *
+ */
+static void slab_free_desc(kmem_cache_t *cache, slab_t *slab) {
+  if (cache->off_slab) {
+    void *desc = slab;
+    slab_free_objs(kmalloc_cache_for(slab_desc_size(cache)), &desc, 1);
+  }
+}
 
 /**
  * @brief allocate and setup a slab
  * to be added in slabs_empty of a cache
  * @param cache pointer to which this slab is part of
+ * @param colour first object is moved by colour * colour_off bytes
  */
-static slab_t *alloc_slab(kmem_cache_t *cache) {
-  /*get a page from buddy allocator*/
-  page_t *page = get_free_page();
+static slab_t *alloc_slab(kmem_cache_t *cache, uint32_t colour) {
+  /*get pages from buddy allocator*/
+  page_t *page = get_free_pages(cache->order);
+  if (page == NULL) {
+    return NULL;
+  }
+
+  /*setup slab inside the pages at initial or in a kmalloc object*/
+  slab_t *slab = (slab_t *)get_page_addr(page);
+  if (cache->off_slab) {
+    slab = alloc_slab_mem(kmalloc_cache_for(slab_desc_size(cache)));
+    if (slab == NULL) {
+      free_pages(page, cache->order);
+      return NULL;
+    }
+  }
+  slab->cache = cache;
+  slab->num_alloc_objects = 0;
+  slab->next = NULL;
+  slab->prev = NULL;
+
   /*this page struct is universal for this page
   set this to know that it is oned by slab now
   not buddy allocator*/
-  page->page_owner = OWNER_SLAB;
-  page->owner_kmem_cache_addr = cache;
+  slab_set_pages(page, cache->order, OWNER_SLAB, slab);
 
-  /*setup slab inside the page at initial*/
-  slab_t *slab = (slab_t *)page->start_addr;
-  slab->free = 0;
-  slab->num_alloc_objects = 0;
-  slab->next = NULL;
+  /*kmem_buf_ctl is right after slab, smem from where actual object
+   * allocation will start will be after kmem_buf_ctl and the colour*/
+  uint64_t buf_ctl_array_size = cache->nr_objs;
+  slab->smem = get_page_addr(page) + slab_smem_offset(cache) +
+               (colour * cache->colour_off);
+  if (cache->freeptr) {
+    /*link every object to next one, last one ends the list*/
+    for (uint64_t idx = 0; idx < buf_ctl_array_size; idx++) {
+      uint64_t obj = slab->smem + idx * cache->objsize;
+      uint64_t next =
+          (idx + 1U < buf_ctl_array_size) ? obj + cache->objsize : 0U;
+      *(uint64_t *)obj = freeptr_code(cache, obj, next);
+    }
+    slab->freelist = slab->smem;
+  } else {
+    /*now need to initialise the kmem_buf_ctl*/
+    slab->free = 0;
+    initialize_kmem_buf_ctl((kmem_bufctl_t *)slab_bufctl(slab),
+                            buf_ctl_array_size);
+  }
 
-  /*setup kmem_buf_ctl after slab allocation*/
-  uint64_t buf_ctl_start = (uint64_t)slab + sizeof(slab_t);
-  /*objsize*x + 4*x = total_size
-  so, x = total_size/(4+objsize)
-  x = num of objects that can be allocated
-  */
-  uint64_t buf_ctl_array_size =
-      (((uint64_t)slab + get_page_size()) - buf_ctl_start) /
-      (cache->objsize + sizeof(kmem_bufctl_t));
-  /*so smem from where actual object allocation will start will be after
-   * kmem_buf_ctl*/
-  slab->smem = (buf_ctl_start + buf_ctl_array_size * sizeof(kmem_bufctl_t));
-  /*now need to initialise the kmem_buf_ctl*/
-  initialize_kmem_buf_ctl((kmem_bufctl_t *)slab_bufctl(slab),
-                          buf_ctl_array_size);
+  /*objects are constructed once here, not on every allocation*/
+  if (cache->ctor != NULL) {
+    for (uint64_t idx = 0; idx < buf_ctl_array_size; idx++) {
+      cache->ctor((void *)(slab->smem + idx * cache->objsize));
+    }
+  }
 
   return slab;
 }
 
 /**
- * @brief internal function to create cache for given size
+ * @brief setup empty depot and cpu magazines of a cache
  *
  */
-static kmem_cache_t *alloc_cache(size_t size) {
-  assert(size != 0U); /*this should not happen*/
+static void cache_init_magazines(kmem_cache_t *cache) {
+  spinlock_init(&cache->depot_lock);
+  cache->depot_full = NULL;
+  cache->depot_empty = NULL;
+  cache->depot_nr_full = 0;
+  for (uint8_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+    cache->cpu[cpu].loaded = NULL;
+    cache->cpu[cpu].previous = NULL;
+  }
+}
 
-  /*need to get memory for kmem_cache_t struct*/
-  /*this will definitly return since we have already defined it during bootup*/
-  kmem_cache_t *cache = (kmem_cache_t *)kmem_cache_alloc(sizeof(kmem_cache_t));
-  cache->next = NULL;
-  cache->objsize = size;
-  cache->slabs_full = NULL;
-  cache->slabs_partial = NULL;
-  cache->slabs_empty = alloc_slab(cache);
-  return cache;
+/**
+ * @brief add slab at head of a slab list of the cache
+ * called under cache lock
+ */
+static void slab_list_add(slab_t **list, slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list != NULL) {
+    (*list)->prev = slab;
+  }
+  *list = slab;
 }
 
 /**
- * @brief internal function to get a cache for given size if
- * doesn't exist create one
- *
+ * @brief remove slab from the slab list of the cache it is in
+ * called under cache lock
  */
-static kmem_cache_t *get_size_cache(size_t size) {
-  /*loop in the linked list to see if we already have a cache for this size*/
-  kmem_cache_t *current_cache = global_cache_p;
-  kmem_cache_t *found_cache = NULL;
-  do {
-    if (current_cache->objsize == size) {
-      found_cache = current_cache;
-      break; /*we found one*/
-    }
-    current_cache = current_cache->next;
-  } while (current_cache != global_cache_p);
+static void slab_list_del(slab_t **list, slab_t *slab) {
+  if (slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    *list = slab->next;
+  }
+  if (slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+  slab->next = NULL;
+  slab->prev = NULL;
+}
 
-  if (found_cache != NULL) {
-    return found_cache;
+/**
+ * @brief take a free object out of a slab which has one
+ * called under cache lock, lists are updated by caller
+ */
+static void *slab_get_obj(kmem_cache_t *cache, slab_t *slab) {
+  void *addr = NULL;
+  if (cache->freeptr) {
+    /*free object holds the next free object*/
+    uint64_t obj = slab->freelist;
+    slab->freelist = freeptr_code(cache, obj, *(uint64_t *)obj);
+    addr = (void *)obj;
   } else {
-    /*need to create cache for this size and add it into global cache list*/
-    found_cache = alloc_cache(size);
-    found_cache->next = global_cache_p;
-    global_cache_p = found_cache;
-    return found_cache;
+    addr = (void *)(slab->smem + cache->objsize * slab->free);
+    /*update the free index to value it holds in that index in bufctl array*/
+    kmem_bufctl_t *bufctl_array = slab_bufctl(slab);
+    slab->free = bufctl_array[slab->free];
   }
+  slab->num_alloc_objects++;
+  return addr;
 }
 
 /**
- * @brief internal function to allocate memory from partial slab
- *
+ * @brief give an object back to its slab
+ * called under cache lock, lists are updated by caller
  */
+static void slab_put_obj(kmem_cache_t *cache, slab_t *slab, void *obj) {
+  if (cache->freeptr) {
+    /*object becomes head of the freelist*/
+    *(uint64_t *)obj = freeptr_code(cache, (uint64_t)obj, slab->freelist);
+    slab->freelist = (uint64_t)obj;
+  } else {
+    uint64_t ptr_idx = ((uint64_t)obj - slab->smem) / cache->objsize;
+    /*we need to index to update free in a way that now
+    it will point to this index but this index will contain current free
+    indx*/
+    kmem_bufctl_t current_indx = slab->free;
+    slab->free = ptr_idx;
+    kmem_bufctl_t *bufctl = slab_bufctl(slab);
+    bufctl[ptr_idx] = current_indx;
+  }
+  // dec the num of objects
+  slab->num_alloc_objects--;
+}
 
-static void *alloc_slab_partial_mem(kmem_cache_t *cache) {
+/**
+ * @brief internal function to allocate upto count objects from first partial
+ * slab
+ * @return no of objects allocated
+ */
+static uint64_t alloc_slab_partial_mem(kmem_cache_t *cache, void **objs,
+                                       uint64_t count) {
   slab_t *current_partial_slab = cache->slabs_partial;
-  void *addr = (void *)(current_partial_slab->smem +
-                        cache->objsize * current_partial_slab->free);
-  /*update the free index to value it holds in that index in bufctl array*/
-  kmem_bufctl_t *bufctl_array = slab_bufctl(current_partial_slab);
-  current_partial_slab->free = bufctl_array[current_partial_slab->free];
-  current_partial_slab->num_alloc_objects++;
+  uint64_t got = 0;
+  while ((got < count) &&
+         (current_partial_slab->num_alloc_objects < cache->nr_objs)) {
+    objs[got++] = slab_get_obj(cache, current_partial_slab);
+  }
 
   /*now check if slab got full, then migrate it to slab full*/
-  if (current_partial_slab->free == BUFCTL_END) {
-    /*put the next partial slab to cache slab_partial*/
-    cache->slabs_partial = current_partial_slab->next;
-    /*put this partial slab which got full into slab full at top*/
-    current_partial_slab->next = cache->slabs_full;
-    cache->slabs_full = current_partial_slab;
+  if (current_partial_slab->num_alloc_objects == cache->nr_objs) {
+    slab_list_del(&cache->slabs_partial, current_partial_slab);
+    slab_list_add(&cache->slabs_full, current_partial_slab);
   }
 
-  return addr;
+  return got;
 }
 
 /**
- * @brief internal function to get memory allocated for slab
+ * @brief internal function to get objects allocated from slabs
  * - first it will check in partial_slab, if no partial slab put an empty slab
  * into partial and allocate the memory, also update the buf_ctl
  * - if empty_slab is empty, alloc a new slab
  * - after allocation if partial slab got full, put it in slab_full
+ * - new slab is built without holding the cache lock, so the lock only
+ * covers the list and bufctl updates
+ * a batch takes the lock once and a slab list change per slab
+ * @return no of objects allocated, less than count only if memory ran out
  */
-static void *alloc_slab_mem(kmem_cache_t *cache) {
-  /*look into partial slab if memory is there*/
-  if (cache->slabs_partial != NULL) {
-    return alloc_slab_partial_mem(cache);
-  } else {
-    /*get one slab from empty_slab and if empty is also null alloc one slab,
-    then put it into slab partial then allocate the memory required*/
-    if (cache->slabs_empty == NULL) {
-      cache->slabs_empty = alloc_slab(cache);
+static uint64_t alloc_slab_objs(kmem_cache_t *cache, void **objs,
+                                uint64_t count) {
+  uint64_t got = 0;
+  spinlock_acquire(&cache->lock);
+  while (got < count) {
+    if ((cache->slabs_partial == NULL) && (cache->slabs_empty == NULL)) {
+      /*grow the cache, page allocation and bufctl setup done without lock*/
+      uint32_t colour = cache->colour_next;
+      cache->colour_next = (colour + 1U) % cache->colour;
+      spinlock_release(&cache->lock);
+      slab_t *slab = alloc_slab(cache, colour);
+      if (slab == NULL) {
+        return got;
+      }
+      spinlock_acquire(&cache->lock);
+      slab_list_add(&cache->slabs_empty, slab);
+      cache->nr_empty++;
     }
 
-    /*put the empty_slab in partial slab*/
-    slab_t *empty_slab = cache->slabs_empty;
-    cache->slabs_empty = empty_slab->next;
-    empty_slab->next = cache->slabs_partial;
-    cache->slabs_partial = empty_slab;
+    /*look into partial slab if memory is there else get one slab from
+    empty_slab, then put it into slab partial*/
+    if (cache->slabs_partial == NULL) {
+      /*put the empty_slab in partial slab*/
+      slab_t *empty_slab = cache->slabs_empty;
+      slab_list_del(&cache->slabs_empty, empty_slab);
+      cache->nr_empty--;
+      slab_list_add(&cache->slabs_partial, empty_slab);
+    }
 
     // Now allocate the memory
-    return alloc_slab_partial_mem(cache);
+    got += alloc_slab_partial_mem(cache, &objs[got], count - got);
+  }
+  spinlock_release(&cache->lock);
+  return got;
+}
+
+/**
+ * @brief internal function to get one object allocated from slabs
+ *
+ */
+static void *alloc_slab_mem(kmem_cache_t *cache) {
+  void *addr = NULL;
+  alloc_slab_objs(cache, &addr, 1U);
+  return addr;
+}
+
+/**
+ * @brief internal function to give objects back to their slabs
+ * cache lock is taken once for all of them, objects of the same slab in a
+ * row are freed with one slab lookup and list change
+ * - a full slab goes back to partial list
+ * - a slab which has no allocated object left goes to empty list, empty
+ * slabs over the cache limit are released by the reaper
+ */
+static void slab_free_objs(kmem_cache_t *cache, void **objs, uint64_t count) {
+  uint64_t slab_size = (uint64_t)get_page_size() << cache->order;
+  spinlock_acquire(&cache->lock);
+  for (uint64_t idx = 0; idx < count;) {
+    page_t *page = get_page_struct(get_page_indx((uint64_t)objs[idx]));
+    slab_t *slab = page->owner_slab;
+    uint64_t start = _aligntill((uint64_t)objs[idx], slab_size);
+    uint8_t was_full = (slab->num_alloc_objects == cache->nr_objs);
+    do {
+      slab_put_obj(cache, slab, objs[idx]);
+      idx++;
+    } while ((idx < count) &&
+             (_aligntill((uint64_t)objs[idx], slab_size) == start));
+
+    /*move it to the list it belongs now*/
+    if (slab->num_alloc_objects == 0U) {
+      slab_list_del(was_full ? &cache->slabs_full : &cache->slabs_partial,
+                    slab);
+      slab_list_add(&cache->slabs_empty, slab);
+      cache->nr_empty++;
+    } else if (was_full) {
+      slab_list_del(&cache->slabs_full, slab);
+      slab_list_add(&cache->slabs_partial, slab);
+    }
+  }
+  spinlock_release(&cache->lock);
+}
+
+/**
+ * @brief get a magazine without objects from magazine cache slabs
+ *
+ */
+static magazine_t *alloc_magazine(void) {
+  magazine_t *magazine = (magazine_t *)alloc_slab_mem(magazine_cache);
+  if (magazine != NULL) {
+    magazine->next = NULL;
+    magazine->rounds = 0;
+  }
+  return magazine;
+}
+
+/**
+ * @brief give objects of a magazine back to their slabs and free it
+ *
+ */
+static void free_magazine(kmem_cache_t *cache, magazine_t *magazine) {
+  slab_free_objs(cache, magazine->objs, magazine->rounds);
+  void *obj = magazine;
+  slab_free_objs(magazine_cache, &obj, 1);
+}
+
+/**
+ * @brief take a magazine from the depot
+ * @param full take one with objects, else one without objects
+ * @return magazine or NULL if depot has none
+ */
+static magazine_t *depot_get(kmem_cache_t *cache, uint8_t full) {
+  spinlock_acquire(&cache->depot_lock);
+  magazine_t **list = full ? &cache->depot_full : &cache->depot_empty;
+  magazine_t *magazine = *list;
+  if (magazine != NULL) {
+    *list = magazine->next;
+    magazine->next = NULL;
+    cache->depot_nr_full -= full;
+  }
+  spinlock_release(&cache->depot_lock);
+  return magazine;
+}
+
+/**
+ * @brief give a magazine to the depot, a magazine with objects is emptied
+ * into slabs when depot already has DEPOT_MAX_FULL of them
+ */
+static void depot_put(kmem_cache_t *cache, magazine_t *magazine) {
+  spinlock_acquire(&cache->depot_lock);
+  if (magazine->rounds == 0U) {
+    magazine->next = cache->depot_empty;
+    cache->depot_empty = magazine;
+    magazine = NULL;
+  } else if (cache->depot_nr_full < DEPOT_MAX_FULL) {
+    magazine->next = cache->depot_full;
+    cache->depot_full = magazine;
+    cache->depot_nr_full++;
+    magazine = NULL;
+  }
+  spinlock_release(&cache->depot_lock);
+
+  if (magazine != NULL) {
+    free_magazine(cache, magazine);
+  }
+}
+
+/**
+ * @brief current cpu magazines of a cache
+ * should be called with irq disabled
+ */
+static kmem_cpu_cache_t *get_cpu_cache(kmem_cache_t *cache) {
+  return &cache->cpu[get_mpidr() & MPIDR_AFF0_MASK];
+}
+
+/**
+ * @brief internal function to allocate an object through cpu magazines
+ * - pop from loaded magazine, if it is empty and previous has objects swap
+ * them
+ * - if both are empty exchange previous for a full magazine from the depot
+ * - if depot has none allocate from slabs
+ * irq is disabled while cpu magazines are touched since an isr on this cpu
+ * can also allocate, depot and slabs are used outside it since releasing a
+ * lock enables the irq again
+ */
+static void *magazine_alloc(kmem_cache_t *cache) {
+  void *obj = NULL;
+  psw_t psw;
+
+  psw_disable_and_save_interrupt(&psw);
+  kmem_cpu_cache_t *cpu = get_cpu_cache(cache);
+  if (((cpu->loaded == NULL) || (cpu->loaded->rounds == 0U)) &&
+      (cpu->previous != NULL) && (cpu->previous->rounds != 0U)) {
+    magazine_t *magazine = cpu->loaded;
+    cpu->loaded = cpu->previous;
+    cpu->previous = magazine;
+  }
+  if ((cpu->loaded != NULL) && (cpu->loaded->rounds != 0U)) {
+    obj = cpu->loaded->objs[--cpu->loaded->rounds];
+  }
+  psw_restore_interrupt(&psw);
+  if (obj != NULL) {
+    return obj;
+  }
+
+  magazine_t *full = depot_get(cache, 1U);
+  if (full == NULL) {
+    return alloc_slab_mem(cache);
+  }
+  psw_disable_and_save_interrupt(&psw);
+  cpu = get_cpu_cache(cache);
+  magazine_t *old = cpu->previous;
+  cpu->previous = cpu->loaded;
+  cpu->loaded = full;
+  obj = full->objs[--full->rounds];
+  psw_restore_interrupt(&psw);
+
+  if (old != NULL) {
+    depot_put(cache, old);
+  }
+  return obj;
+}
+
+/**
+ * @brief internal function to free an object through cpu magazines
+ * - push to loaded magazine, if it is full and previous has room swap them
+ * - if both are full exchange previous for an empty magazine from the depot
+ * or a new one
+ * - if no magazine can be had free it to its slab
+ * object can be from any cpu, magazines hold any object of the cache
+ */
+static void magazine_free(kmem_cache_t *cache, void *obj) {
+  uint8_t done = 0U;
+  psw_t psw;
+
+  psw_disable_and_save_interrupt(&psw);
+  kmem_cpu_cache_t *cpu = get_cpu_cache(cache);
+  if (((cpu->loaded == NULL) || (cpu->loaded->rounds == MAGAZINE_SIZE)) &&
+      (cpu->previous != NULL) && (cpu->previous->rounds < MAGAZINE_SIZE)) {
+    magazine_t *magazine = cpu->loaded;
+    cpu->loaded = cpu->previous;
+    cpu->previous = magazine;
+  }
+  if ((cpu->loaded != NULL) && (cpu->loaded->rounds < MAGAZINE_SIZE)) {
+    cpu->loaded->objs[cpu->loaded->rounds++] = obj;
+    done = 1U;
+  }
+  psw_restore_interrupt(&psw);
+  if (done) {
+    return;
+  }
+
+  magazine_t *empty = depot_get(cache, 0U);
+  if (empty == NULL) {
+    empty = alloc_magazine();
+  }
+  if (empty == NULL) {
+    slab_free_objs(cache, &obj, 1);
+    return;
+  }
+  psw_disable_and_save_interrupt(&psw);
+  cpu = get_cpu_cache(cache);
+  magazine_t *old = cpu->previous;
+  cpu->previous = cpu->loaded;
+  cpu->loaded = empty;
+  empty->objs[empty->rounds++] = obj;
+  psw_restore_interrupt(&psw);
+
+  if (old != NULL) {
+    depot_put(cache, old);
+  }
+}
+
+/**
+ * @brief give objects parked in the depot and current cpu magazines back to
+ * slabs so that empty slabs can be released
+ * other cpus magazines are left alone since only the owner cpu touches them
+ */
+static void cache_flush_magazines(kmem_cache_t *cache) {
+  psw_t psw;
+
+  spinlock_acquire(&cache->depot_lock);
+  magazine_t *full = cache->depot_full;
+  magazine_t *empty = cache->depot_empty;
+  cache->depot_full = NULL;
+  cache->depot_empty = NULL;
+  cache->depot_nr_full = 0;
+  spinlock_release(&cache->depot_lock);
+
+  psw_disable_and_save_interrupt(&psw);
+  kmem_cpu_cache_t *cpu = get_cpu_cache(cache);
+  magazine_t *loaded = cpu->loaded;
+  magazine_t *previous = cpu->previous;
+  cpu->loaded = NULL;
+  cpu->previous = NULL;
+  psw_restore_interrupt(&psw);
+
+  magazine_t *lists[] = {full, empty, loaded, previous};
+  for (uint8_t idx = 0; idx < (sizeof(lists) / sizeof(lists[0])); idx++) {
+    /*loaded and previous are single magazines, their next is NULL*/
+    magazine_t *magazine = lists[idx];
+    while (magazine != NULL) {
+      magazine_t *next = magazine->next;
+      free_magazine(cache, magazine);
+      magazine = next;
+    }
   }
 }
 
@@ -181,13 +797,11 @@ static void *alloc_slab_mem(kmem_cache_t *cache) {
 void *kmem_cache_alloc(size_t size) {
   /*don't call it before kmem_cache_boot_init*/
   assert(global_cache_p != NULL);
-  /*sanity check if size is actually less than page_size*/
-  assert(size < get_page_size());
+  /*sanity check if size fits in a size class*/
+  assert((size != 0U) && (size <= KMALLOC_MAX_CLASS_SIZE));
 
-  /*get cache for the size*/
-  kmem_cache_t *cache = get_size_cache(size);
-  /*allocate the memory from the slab*/
-  return alloc_slab_mem(cache);
+  /*allocate the memory through cpu magazines of the size class cache*/
+  return magazine_alloc(kmalloc_cache_for(size));
 }
 
 /**
@@ -196,25 +810,448 @@ void *kmem_cache_alloc(size_t size) {
  * based on cache_addr
  */
 void kmem_cache_free(void *ptr, page_t *page) {
-  /**amzing thing is page start_aadr will point to the slab who own this address
-   * :) */
-  slab_t *slab = (slab_t *)page->start_addr;
-  kmem_cache_t *cache = (kmem_cache_t *)page->owner_kmem_cache_addr;
+  /*every page of a slab points to the slab who own this address and slab
+   * knows its cache*/
+  slab_t *slab = page->owner_slab;
+  kmem_cache_t *cache = slab->cache;
   /*need to check ptr is greater than smem or not, else we can't deallocate it*/
   if ((uint64_t)ptr < slab->smem) {
     return;
   }
 
-  uint64_t ptr_idx = ((uint64_t)ptr - slab->smem) / cache->objsize;
-  /*we need to index to update free in a way that now
-  it will point to this index but this index will contain current free indx*/
-  kmem_bufctl_t current_indx = slab->free;
-  slab->free = ptr_idx;
-  kmem_bufctl_t *bufctl = slab_bufctl(slab);
-  bufctl[ptr_idx] = current_indx;
+  /*object goes to current cpu magazine, slab is updated when magazines are
+   * emptied*/
+  magazine_free(cache, ptr);
+}
 
-  // dec the num of objects
-  slab->num_alloc_objects--;
+/**
+ * @brief check if slab in the page has no allocated object
+ * read without any lock so it is only a hint, slab can be released meanwhile
+ * but its descriptor stays mapped memory
+ */
+uint8_t kmem_cache_slab_empty(page_t *page) {
+  slab_t *slab = page->owner_slab;
+  if (slab == NULL) {
+    return 0U; /*released or not setup yet*/
+  }
+  return (slab->num_alloc_objects == 0U);
+}
+
+/**
+ * @brief take an empty slab away from its cache so that the pages can be
+ * reused (ex: by compaction)
+ * cache chain lock is held so slab can't be released or its cache destroyed
+ * while owner_slab is followed, it is only tried since compaction can run
+ * from an isr which interrupted the reaper
+ * @return ESUCCESS if slab is detached, pages are then owned by caller
+ */
+uint8_t kmem_cache_detach_empty_slab(page_t *page) {
+  uint8_t ret = EFAILURE;
+
+  if (try_spinlock_acquire(&cache_chain_lock) != ESUCCESS) {
+    return EBUSY;
+  }
+  slab_t *slab = page->owner_slab;
+  if ((page->page_owner != OWNER_SLAB) || (slab == NULL)) {
+    spinlock_release(&cache_chain_lock);
+    return EFAILURE;
+  }
+  kmem_cache_t *cache = slab->cache;
+
+  spinlock_acquire(&cache->lock);
+  /*objects are taken from a slab under cache lock only*/
+  if (slab->num_alloc_objects == 0U) {
+    /*empty slab is always in the empty list*/
+    slab_list_del(&cache->slabs_empty, slab);
+    cache->nr_empty--;
+    page_t *first = slab_release_pages(cache, slab);
+    assert(first == page);
+    page->page_owner = OWNER_COUNT;
+    ret = ESUCCESS;
+  }
+  spinlock_release(&cache->lock);
+  spinlock_release(&cache_chain_lock);
+
+  if (ret == ESUCCESS) {
+    slab_free_desc(cache, slab);
+  }
+  return ret;
+}
+
+/**
+ * @brief no of pages in empty slabs over all caches
+ * read without cache locks so it is only a hint, cache list is held so that
+ * a cache can't be destroyed under the walk, nothing is counted if it is busy
+ * since reclaim can run from an isr which interrupted a list update
+ */
+static uint64_t slab_shrink_count(void) {
+  uint64_t count = 0;
+  kmem_cache_t *cache = global_cache_p;
+  if (try_spinlock_acquire(&cache_chain_lock) != ESUCCESS) {
+    return 0;
+  }
+  do {
+    count += cache->nr_empty << cache->order;
+    /*parked magazines may be all that keeps some slabs busy*/
+    count += cache->depot_nr_full;
+    cache = cache->next;
+  } while (cache != global_cache_p);
+  spinlock_release(&cache_chain_lock);
+  return count;
+}
+
+/**
+ * @brief give back empty slabs of a cache to buddy till only keep of them
+ * are left or nr_slabs are given back
+ * slabs are unlinked under the cache lock and freed after dropping it
+ * @return no of slabs given back
+ */
+static uint64_t cache_shrink(kmem_cache_t *cache, uint64_t nr_slabs,
+                             uint64_t keep) {
+  page_t *pages[SLAB_SHRINK_BATCH];
+  slab_t *slabs[SLAB_SHRINK_BATCH];
+  uint64_t count = 0;
+
+  spinlock_acquire(&cache->lock);
+  while ((cache->nr_empty > keep) && (count < nr_slabs) &&
+         (count < SLAB_SHRINK_BATCH)) {
+    /*oldest empty slabs are at the tail but head is as good and O(1)*/
+    slab_t *slab = cache->slabs_empty;
+    slab_list_del(&cache->slabs_empty, slab);
+    cache->nr_empty--;
+    slabs[count] = slab;
+    pages[count++] = slab_release_pages(cache, slab);
+  }
+  spinlock_release(&cache->lock);
+
+  for (uint64_t idx = 0; idx < count; idx++) {
+    slab_free_desc(cache, slabs[idx]);
+  }
+  free_pages_bulk(pages, count, cache->order);
+  return count;
+}
+
+/**
+ * @brief give back upto nr_pages empty slabs over all caches to buddy
+ * cache list is held for the walk like slab_shrink_count
+ */
+static uint64_t slab_shrink_scan(uint64_t nr_pages) {
+  uint64_t freed = 0;
+  kmem_cache_t *cache = global_cache_p;
+  if (try_spinlock_acquire(&cache_chain_lock) != ESUCCESS) {
+    return 0;
+  }
+  do {
+    uint64_t released = 0;
+    cache_flush_magazines(cache);
+    /*a cache gives back SLAB_SHRINK_BATCH slabs at most in one go*/
+    do {
+      uint64_t nr_slabs =
+          (nr_pages - freed + BIT(cache->order) - 1U) >> cache->order;
+      released = cache_shrink(cache, nr_slabs, 0U);
+      freed += released << cache->order;
+    } while ((released == SLAB_SHRINK_BATCH) && (freed < nr_pages));
+    cache = cache->next;
+  } while ((cache != global_cache_p) && (freed < nr_pages));
+  spinlock_release(&cache_chain_lock);
+  return freed;
+}
+
+/**
+ * @brief give empty slabs over empty_limit of every cache back to buddy
+ * slabs emptied by a burst of frees would else stay with the cache till
+ * memory runs low
+ */
+void slab_reap_idle_work(void) {
+  uint64_t cpu_id = get_mpidr() & MPIDR_AFF0_MASK;
+  uint64_t now = get_system_timestamp_ns();
+  if ((now - last_reap_run[cpu_id]) < SLAB_REAP_INTERVAL_NS) {
+    return;
+  }
+  last_reap_run[cpu_id] = now;
+
+  /*cache list is held for the walk like the shrinker, skip if busy*/
+  kmem_cache_t *cache = global_cache_p;
+  if (try_spinlock_acquire(&cache_chain_lock) != ESUCCESS) {
+    return;
+  }
+  do {
+    uint64_t released = 0;
+    do {
+      released = cache_shrink(cache, SLAB_SHRINK_BATCH, cache->empty_limit);
+    } while (released == SLAB_SHRINK_BATCH);
+    cache = cache->next;
+  } while (cache != global_cache_p);
+  spinlock_release(&cache_chain_lock);
+}
+
+/**
+ * @brief callbacks are filled at runtime since static pointer initialisers
+ * are not relocated
+ */
+static shrinker_t slab_shrinker;
+
+/**
+ * @brief internal function to create cache for given size and add it to the
+ * global cache list
+ * kmem_cache_t comes straight from cache_cache slabs
+ * @param size object size, already a multiple of align
+ * @return cache or NULL if object doesn't fit a slab
+ */
+static kmem_cache_t *alloc_cache(const char *name, size_t size, size_t align,
+                                 uint32_t flags, kmem_ctor_t ctor) {
+  assert(size != 0U); /*this should not happen*/
+
+  /*need to get memory for kmem_cache_t struct*/
+  kmem_cache_t *cache = (kmem_cache_t *)alloc_slab_mem(&cache_cache);
+  if (cache == NULL) {
+    return NULL;
+  }
+  cache->name = name;
+  cache->ctor = ctor;
+  cache->align = align;
+  cache->objsize = size;
+  /*free pointer would overwrite constructed objects*/
+  cache->freeptr = (flags & KMEM_CACHE_FREEPTR) && (ctor == NULL);
+  cache->freeptr_key = freeptr_new_key(cache);
+  if (cache_init_layout(cache, 1U) != ESUCCESS) {
+    void *obj = cache;
+    slab_free_objs(&cache_cache, &obj, 1);
+    return NULL;
+  }
+  cache->slabs_full = NULL;
+  cache->slabs_partial = NULL;
+  cache->slabs_empty = NULL; /*grown on first allocation*/
+  cache->nr_empty = 0;
+  cache->empty_limit = cache_empty_limit(cache);
+  cache_init_colour(cache);
+  if (flags & KMEM_CACHE_NO_COLOUR) {
+    cache->colour = 1U;
+  }
+  spinlock_init(&cache->lock);
+  cache_init_magazines(cache);
+
+  spinlock_acquire(&cache_chain_lock);
+  /*add it after head to keep the list circular*/
+  cache->next = global_cache_p->next;
+  global_cache_p->next = cache;
+  spinlock_release(&cache_chain_lock);
+  return cache;
+}
+
+/**
+ * @brief create a named cache for objects of one type
+ * object size is rounded up to the alignment so every object in the slab
+ * stays aligned
+ * @return cache or NULL if object doesn't fit a slab
+ */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                uint32_t flags, kmem_ctor_t ctor) {
+  /*don't call it before kmem_cache_boot_init*/
+  assert(global_cache_p != NULL);
+  if (align < SLAB_MIN_ALIGN) {
+    align = SLAB_MIN_ALIGN;
+  }
+  if ((size == 0U) || !_is_power_of_two(align) ||
+      (align > get_page_size())) {
+    return NULL;
+  }
+  uint64_t objsize = _alignto((uint64_t)size, (uint64_t)align);
+  return alloc_cache(name, objsize, align, flags, ctor);
+}
+
+/**
+ * @brief create the aligned size class cache for a slot
+ * cache is created without lock and installed under it, cpu which loses the
+ * race destroys its own copy
+ * @return cache in the slot, NULL if no memory
+ */
+static kmem_cache_t *kmalloc_aligned_cache(kmem_cache_t **slot, uint8_t class,
+                                           uint64_t align) {
+  uint64_t class_size = kmalloc_class_size[class];
+  kmem_cache_t *cache = alloc_cache(
+      "kmalloc-aligned", _alignto(class_size, align), align, 0U, NULL);
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  spinlock_acquire(&kmalloc_aligned_lock);
+  kmem_cache_t *installed = *slot;
+  if (installed == NULL) {
+    *slot = cache;
+    installed = cache;
+    cache = NULL;
+  }
+  spinlock_release(&kmalloc_aligned_lock);
+  if (cache != NULL) {
+    kmem_cache_destroy(cache);
+  }
+  return installed;
+}
+
+/**
+ * @brief function to allocate aligned
+ * memory from slab allocator
+ * size is rounded up to align first and then to its size class, the class
+ * cache for align keeps every object start aligned
+ */
+void *kmem_cache_alloc_aligned(size_t size, size_t align) {
+  /*don't call it before kmem_cache_boot_init*/
+  assert(global_cache_p != NULL);
+  assert((size != 0U) && _is_power_of_two(align));
+  if (align <= SLAB_MIN_ALIGN) {
+    return kmem_cache_alloc(size);
+  }
+
+  uint64_t aligned_size = _alignto((uint64_t)size, (uint64_t)align);
+  assert(aligned_size <= KMALLOC_MAX_CLASS_SIZE);
+  uint8_t class =
+      kmalloc_class_index[(aligned_size - 1U) / KMALLOC_CLASS_STEP];
+  kmem_cache_t **slot =
+      &kmalloc_aligned_caches[class][_get_p2(align) - KMALLOC_MIN_ALIGN_SHIFT];
+  /*slot is written once under the lock after cache is set up*/
+  kmem_cache_t *cache = *slot;
+  if (cache == NULL) {
+    cache = kmalloc_aligned_cache(slot, class, align);
+    if (cache == NULL) {
+      return NULL;
+    }
+  }
+  return magazine_alloc(cache);
+}
+
+/**
+ * @brief give all magazines of a cache back to its slabs, other cpus
+ * magazines too since no cpu uses a cache being destroyed
+ */
+static void cache_flush_all_magazines(kmem_cache_t *cache) {
+  cache_flush_magazines(cache);
+  for (uint8_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+    magazine_t *magazines[] = {cache->cpu[cpu].loaded,
+                               cache->cpu[cpu].previous};
+    cache->cpu[cpu].loaded = NULL;
+    cache->cpu[cpu].previous = NULL;
+    for (uint8_t idx = 0; idx < (sizeof(magazines) / sizeof(magazines[0]));
+         idx++) {
+      if (magazines[idx] != NULL) {
+        free_magazine(cache, magazines[idx]);
+      }
+    }
+  }
+}
+
+/**
+ * @brief destroy a cache created by kmem_cache_create
+ * - magazines are emptied into slabs first
+ * - cache is left as it is if any slab still has an allocated object
+ * - else cache is unlinked from the global list and its slabs and struct are
+ * freed
+ * @return ESUCCESS or EBUSY if cache still has allocated objects
+ */
+uint8_t kmem_cache_destroy(kmem_cache_t *cache) {
+  /*boot caches are never destroyed*/
+  assert((cache != &cache_cache) && (cache != magazine_cache));
+
+  /*shrinker walks the cache list holding the lock, so it is held before
+   * magazines of other cpus are touched*/
+  spinlock_acquire(&cache_chain_lock);
+  cache_flush_all_magazines(cache);
+  spinlock_acquire(&cache->lock);
+  uint8_t busy = (cache->slabs_full != NULL) || (cache->slabs_partial != NULL);
+  spinlock_release(&cache->lock);
+  if (busy) {
+    spinlock_release(&cache_chain_lock);
+    return EBUSY;
+  }
+  kmem_cache_t *prev = global_cache_p;
+  while (prev->next != cache) {
+    prev = prev->next;
+  }
+  prev->next = cache->next;
+
+  /*slabs are given back under the chain lock like the shrinker, then
+   * nobody can reach the cache*/
+  uint64_t released = 0;
+  do {
+    released = cache_shrink(cache, SLAB_SHRINK_BATCH, 0U);
+  } while (released == SLAB_SHRINK_BATCH);
+  spinlock_release(&cache_chain_lock);
+
+  void *obj = cache;
+  slab_free_objs(&cache_cache, &obj, 1);
+  return ESUCCESS;
+}
+
+/**
+ * @brief allocate objects from a named cache in one go
+ * current cpu magazines are emptied first, rest comes from slabs under one
+ * cache lock
+ * @return no of objects allocated, less than count only if memory ran out
+ */
+uint64_t kmem_cache_alloc_bulk(kmem_cache_t *cache, uint64_t count,
+                               void **objs) {
+  uint64_t got = 0;
+  psw_t psw;
+
+  psw_disable_and_save_interrupt(&psw);
+  kmem_cpu_cache_t *cpu = get_cpu_cache(cache);
+  magazine_t *magazines[] = {cpu->loaded, cpu->previous};
+  for (uint8_t idx = 0; idx < (sizeof(magazines) / sizeof(magazines[0]));
+       idx++) {
+    while ((magazines[idx] != NULL) && (magazines[idx]->rounds != 0U) &&
+           (got < count)) {
+      objs[got++] = magazines[idx]->objs[--magazines[idx]->rounds];
+    }
+  }
+  psw_restore_interrupt(&psw);
+
+  if (got < count) {
+    got += alloc_slab_objs(cache, &objs[got], count - got);
+  }
+  return got;
+}
+
+/**
+ * @brief free objects to the named cache they were allocated from in one go
+ * current cpu magazines are filled first, rest goes to slabs under one cache
+ * lock, objects of the same slab next to each other are cheapest
+ */
+void kmem_cache_free_bulk(kmem_cache_t *cache, uint64_t count, void **objs) {
+  uint64_t done = 0;
+  psw_t psw;
+
+  psw_disable_and_save_interrupt(&psw);
+  kmem_cpu_cache_t *cpu = get_cpu_cache(cache);
+  magazine_t *magazines[] = {cpu->loaded, cpu->previous};
+  for (uint8_t idx = 0; idx < (sizeof(magazines) / sizeof(magazines[0]));
+       idx++) {
+    while ((magazines[idx] != NULL) &&
+           (magazines[idx]->rounds < MAGAZINE_SIZE) && (done < count)) {
+      magazines[idx]->objs[magazines[idx]->rounds++] = objs[done++];
+    }
+  }
+  psw_restore_interrupt(&psw);
+
+  if (done < count) {
+    slab_free_objs(cache, &objs[done], count - done);
+  }
+}
+
+/**
+ * @brief allocate an object from a named cache
+ *
+ */
+void *kmem_cache_alloc_obj(kmem_cache_t *cache) {
+  return magazine_alloc(cache);
+}
+
+/**
+ * @brief free an object to the named cache it was allocated from
+ *
+ */
+void kmem_cache_free_obj(kmem_cache_t *cache, void *obj) {
+  assert(((uint64_t)obj & (cache->align - 1U)) == 0U);
+  magazine_free(cache, obj);
 }
 
 /**
@@ -227,8 +1264,47 @@ void kmem_cache_boot_init(void) {
   // initialise cache to be use of kmem_cache_t object
   global_cache_p = &cache_cache;
   cache_cache.next = &cache_cache; /*circular cache list*/
-  cache_cache.objsize = sizeof(kmem_cache_t);
+  cache_cache.name = "kmem_cache";
+  cache_cache.ctor = NULL;
+  /*cpu magazines of a cache are on their own cache lines only if the cache
+   * is*/
+  cache_cache.align = CACHE_LINE_SIZE;
+  cache_cache.objsize = _alignto(sizeof(kmem_cache_t), cache_cache.align);
   cache_cache.slabs_full = NULL;
   cache_cache.slabs_partial = NULL;
-  cache_cache.slabs_empty = alloc_slab(&cache_cache);
+  /*descriptor stays in slab, kmalloc caches don't exist yet*/
+  if (cache_init_layout(&cache_cache, 0U) != ESUCCESS) {
+    fatal("kmem_cache doesn't fit a slab\n");
+  }
+  cache_init_colour(&cache_cache);
+  cache_cache.slabs_empty = alloc_slab(&cache_cache, 0U);
+  cache_cache.nr_empty = 1U;
+  cache_cache.empty_limit = cache_empty_limit(&cache_cache);
+  cache_cache.colour_next = 1U % cache_cache.colour;
+  spinlock_init(&cache_cache.lock);
+  cache_init_magazines(&cache_cache);
+
+  /*every size class gets its cache now so lookup never needs to create one*/
+  for (uint8_t class = 0; class < KMALLOC_CLASSES; class++) {
+    kmalloc_caches[class] =
+        alloc_cache("kmalloc", kmalloc_class_size[class], SLAB_MIN_ALIGN, 0U,
+                    NULL);
+    if (kmalloc_caches[class] == NULL) {
+      fatal("kmalloc cache creation failed\n");
+    }
+  }
+  /*magazines get a cache of their own so that they don't pin slabs of
+   * kmalloc objects with the same size*/
+  magazine_cache = kmem_cache_create("magazine", sizeof(magazine_t),
+                                     SLAB_MIN_ALIGN, 0U, NULL);
+  if (magazine_cache == NULL) {
+    fatal("magazine cache creation failed\n");
+  }
+
+  /*empty slabs are given back under memory pressure*/
+  slab_shrinker.count = slab_shrink_count;
+  slab_shrinker.scan = slab_shrink_scan;
+  if (register_shrinker(&slab_shrinker) != ESUCCESS) {
+    fatal("slab shrinker registration failed\n");
+  }
 }
@@ -1,8 +1,83 @@
 #ifndef __SLAB_H__
 #define __SLAB_H__
 
+#include "board.h"
 #include "mm.h"
 #include <stdint.h>
+
+/**
+ * @brief kmalloc size classes served by slab caches
+ * KMALLOC_CLASS_STEP is the granularity of the size to class lookup table,
+ * bigger sizes are served by buddy allocator
+ */
+#define KMALLOC_CLASSES 16U
+#define KMALLOC_CLASS_STEP 8U
+#define KMALLOC_MAX_CLASS_SIZE 3072U
+
+/**
+ * @brief aligned kmalloc caches exist for alignments 16 to 2048 bytes
+ * (2^KMALLOC_MIN_ALIGN_SHIFT onwards), bigger alignment can't fit a size class
+ */
+#define KMALLOC_MIN_ALIGN_SHIFT 4U
+#define KMALLOC_ALIGN_CLASSES 8U
+
+/**
+ * @brief every slab object starts at least at this alignment
+ *
+ */
+#define SLAB_MIN_ALIGN 8UL
+
+/**
+ * @brief biggest slab is 2^SLAB_MAX_ORDER pages
+ * a cache takes the smallest order which wastes at most 1/SLAB_WASTE_RATIO
+ * of the slab, else the order which wastes least
+ */
+#define SLAB_MAX_ORDER 3U
+#define SLAB_WASTE_RATIO 8U
+
+/**
+ * @brief objects of atleast this size can have their slab descriptor and
+ * bufctl array kept off slab in a kmalloc object, smaller objects keep it in
+ * the slab so off slab descriptors never need one themselves
+ */
+#define SLAB_OFF_SLAB_MIN_SIZE 512U
+
+/**
+ * @brief empty slabs a cache keeps when reaper runs, enough to hold
+ * SLAB_REAP_KEEP_OBJS objects and atleast one slab, so a cpu can refill both
+ * its magazines without growing the cache
+ */
+#define SLAB_REAP_KEEP_OBJS (2U * MAGAZINE_SIZE)
+#define SLAB_REAP_INTERVAL_NS 1000000000UL /*1s*/
+
+/**
+ * @brief kmem_cache_create flags
+ * KMEM_CACHE_FREEPTR links free objects through a free pointer in every free
+ * object instead of the bufctl array after the slab descriptor, it is
+ * ignored for caches with a constructor since a free pointer would break
+ * constructed state
+ * KMEM_CACHE_NO_COLOUR starts objects of every slab at the same offset
+ */
+#define KMEM_CACHE_FREEPTR (1U << 0)
+#define KMEM_CACHE_NO_COLOUR (1U << 1)
+
+/**
+ * @brief object constructor of a named cache
+ * it is run on every object once when its slab is built
+ */
+typedef void (*kmem_ctor_t)(void *obj);
+
+/**
+ * @brief no of objects a magazine holds, keeps magazine_t at 128 bytes
+ *
+ */
+#define MAGAZINE_SIZE 14U
+
+/**
+ * @brief no of non empty magazines a cache depot keeps, more are emptied back
+ * into slabs so parked objects don't pin slab pages
+ */
+#define DEPOT_MAX_FULL 8U
 /**
  * @brief free object position
  * in the slab page
@@ -12,34 +87,82 @@ typedef uint32_t kmem_bufctl_t;
 
 /**
  * @brief slab struct to hold pages
- * one slab contains one page
- * and next page will be in linked list
- * these pages will gets moved to partial or full slab list
+ * one slab contains 2^order pages of its cache
+ * and next slab will be in linked list
+ * these slabs will gets moved to partial or full slab list
  * when their conditioned are met
+ * it is at start of the slab pages or off slab in a kmalloc object
  */
 typedef struct slab {
-  kmem_bufctl_t free; /*index to free object and next object location will be
-                         the data of the index*/
-  uint8_t padding[4];
-  uint64_t smem; /*this slab page start address*/
+  union {
+    kmem_bufctl_t free; /*index to free object and next object location will
+                           be the data of the index, bufctl mode*/
+    uint64_t freelist;  /*first free object, every free object holds address
+                           of next one, 0 when slab is full, free pointer
+                           mode*/
+  };
+  struct kmem_cache *cache; /*cache which owns this slab*/
+  uint64_t smem;            /*address of first object*/
   uint64_t
       num_alloc_objects; /*gives the num of objects allocated from this slab*/
   struct slab *next;
+  struct slab *prev; /*slab lists are doubly linked to move slabs in O(1)*/
   // kmem_buf_ctl array will be allocated here after slab descriptor, don't have
   // pointer here to save memory :)
 } slab_t;
 
+/**
+ * @brief LIFO array of free objects of one cache
+ * a cpu allocates and frees through its magazines without taking a lock,
+ * slab lists are only touched when magazines run empty or full
+ */
+typedef struct magazine {
+  struct magazine *next; /*link in the depot lists*/
+  uint64_t rounds;       /*no of objects in objs*/
+  void *objs[MAGAZINE_SIZE];
+} magazine_t;
+
+/**
+ * @brief magazines loaded on a cpu, only the owner cpu touches it with irq
+ * disabled, one cache line per cpu
+ */
+typedef struct kmem_cpu_cache {
+  magazine_t *loaded;   /*objects are taken from and given to it first*/
+  magazine_t *previous; /*swapped with loaded when it is empty or full*/
+  uint8_t padding[CACHE_LINE_SIZE - (2U * sizeof(magazine_t *))];
+} kmem_cpu_cache_t;
+
 /**
  * @brief kmem_cache structure to holds slabs
  *
  */
 typedef struct kmem_cache {
   struct kmem_cache *next; /*points to next kmem_cache*/
+  const char *name;        /*name of the cache, not copied*/
+  kmem_ctor_t ctor;        /*object constructor, can be NULL*/
+  uint64_t align;          /*object alignment, power of 2*/
+  uint64_t colour_off;     /*bytes between two colours*/
+  uint32_t colour;         /*no of colours a slab can start at*/
+  uint32_t colour_next;    /*colour of next slab*/
+  uint32_t nr_objs;        /*no of objects in a slab*/
+  uint8_t order;           /*slab is 2^order pages*/
+  uint8_t off_slab;        /*slab descriptor is kept off slab*/
+  uint8_t freeptr;         /*free objects are linked through themselves*/
+  uint8_t padding[1];
+  uint64_t freeptr_key;    /*free pointers are xored with it, see
+                              MM_SLAB_FREEPTR_OBFUSCATE*/
   slab_t *slabs_full;      /*when slabs gets full*/
   slab_t *slabs_partial;   /*when memory is allocatable from slab*/
-  slab_t *slabs_empty;     /*when whole page is empty*/
+  slab_t *slabs_empty;     /*when whole slab is empty*/
+  uint64_t nr_empty;       /*no of slabs in slabs_empty*/
+  uint64_t empty_limit;    /*no of empty slabs reaper leaves to the cache*/
   uint64_t objsize;        /*size of object this cache can allocate*/
-                           // TODO: spinlock
+  spinlock_t lock;         /*protects slab lists and their bufctl arrays*/
+  spinlock_t depot_lock;   /*protects depot lists*/
+  magazine_t *depot_full;  /*magazines with objects, shared by all cpus*/
+  magazine_t *depot_empty; /*magazines without objects*/
+  uint64_t depot_nr_full;  /*no of magazines in depot_full*/
+  kmem_cpu_cache_t cpu[MAX_CPUS]; /*per cpu magazines*/
 } kmem_cache_t;
 
 /**
@@ -52,10 +175,93 @@ void kmem_cache_free(void *ptr, page_t *page);
 /**
  * @brief function to allocate
  * memory from slab allocator based on size
- *
+ * size is rounded up to its size class, should be in
+ * [1, KMALLOC_MAX_CLASS_SIZE]
  */
 void *kmem_cache_alloc(size_t size);
 
+/**
+ * @brief function to allocate aligned
+ * memory from slab allocator
+ * object comes from a size class cache whose objects are all aligned to
+ * align, so it is not rounded up to align when size is smaller
+ * @param size object size
+ * @param align power of 2, size rounded up to it should be at most
+ * KMALLOC_MAX_CLASS_SIZE
+ * @return object or NULL if no memory
+ */
+void *kmem_cache_alloc_aligned(size_t size, size_t align);
+
+/**
+ * @brief create a named cache for objects of one type
+ * @param name name of the cache, should outlive the cache
+ * @param size size of the object
+ * @param align object alignment, power of 2 or 0 for SLAB_MIN_ALIGN
+ * (ex: CACHE_LINE_SIZE to keep hot objects away from false sharing)
+ * @param flags KMEM_CACHE_* flags
+ * @param ctor run on every object once when its slab is built, so objects
+ * should be freed back in their constructed state, can be NULL
+ * @return cache or NULL if object doesn't fit a slab of SLAB_MAX_ORDER
+ */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                uint32_t flags, kmem_ctor_t ctor);
+
+/**
+ * @brief destroy a cache created by kmem_cache_create
+ * caller makes sure no cpu uses the cache any more
+ * @return ESUCCESS or EBUSY if cache still has allocated objects
+ */
+uint8_t kmem_cache_destroy(kmem_cache_t *cache);
+
+/**
+ * @brief allocate an object from a named cache
+ *
+ */
+void *kmem_cache_alloc_obj(kmem_cache_t *cache);
+
+/**
+ * @brief free an object to the named cache it was allocated from
+ *
+ */
+void kmem_cache_free_obj(kmem_cache_t *cache, void *obj);
+
+/**
+ * @brief allocate count objects from a named cache into objs
+ * one call costs about as much as a few single allocations, for callers
+ * which need many objects at once
+ * @return no of objects allocated, less than count only if memory ran out
+ */
+uint64_t kmem_cache_alloc_bulk(kmem_cache_t *cache, uint64_t count,
+                               void **objs);
+
+/**
+ * @brief free count objects in objs to the named cache they came from
+ *
+ */
+void kmem_cache_free_bulk(kmem_cache_t *cache, uint64_t count, void **objs);
+
+/**
+ * @brief check if slab in the page has no allocated object
+ * read without any lock so it is only a hint, released slab reads as busy
+ * @param page first page of the slab
+ */
+uint8_t kmem_cache_slab_empty(page_t *page);
+
+/**
+ * @brief take an empty slab away from its cache so that the pages can be
+ * reused (ex: by compaction)
+ * @param page first page of the slab, block order is in it
+ * @return ESUCCESS if slab is detached, pages are then owned by caller,
+ * EBUSY if cache list is held, EFAILURE if slab is not empty or released
+ */
+uint8_t kmem_cache_detach_empty_slab(page_t *page);
+
+/**
+ * @brief give empty slabs over empty_limit of every cache back to buddy
+ * run from idle, once every SLAB_REAP_INTERVAL_NS on a cpu
+ */
+void slab_reap_idle_work(void);
+
 /**
  * @brief function to initalisr first
  * kmem_cache object
@@ -19,6 +19,17 @@ bool double_spin_check(spinlock_t *lock) {
   return false;
 }
 
+/**
+ * @brief function to init a spinlock embedded in runtime structures
+ *
+ */
+void spinlock_init(spinlock_t *lock) {
+  atomic_store_relaxed(&lock->owner, 0UL);
+  atomic_store_relaxed(&lock->tail, 0UL);
+  lock->thread_cpu = UINT64_MAX;
+  lock->thread = NULL;
+}
+
 /**
  * @brief function to lock spinlock
  */
@@ -96,12 +107,13 @@ void spinlock_release(spinlock_t *lock) {
     return;
   }
 
+  /*clear the thread and cpu information before handing over the lock, else
+  it can wipe the information set by the next owner*/
+  lock->thread = NULL;
+  lock->thread_cpu = UINT64_MAX;
   /*increment the owner ticket*/
   uint64_t ticket = atomic_load_relaxed(&lock->owner);
   atomic_store_explicit(&lock->owner, ticket + 1U, memory_order_release);
-  /*clear the thread and cpu information*/
-  lock->thread = NULL;
-  lock->thread_cpu = UINT64_MAX;
   /*enable irq*/
   enable_irq();
 }
@@ -39,6 +39,12 @@ typedef struct spinlock {
     .owner = 0UL, .tail = 0UL, .thread_cpu = UINT64_MAX, .thread = NULL,       \
   }
 
+/**
+ * @brief function to init a spinlock embedded in runtime structures
+ *
+ */
+void spinlock_init(spinlock_t *lock);
+
 /**
  * @brief function to lock spinlock
  */
@@ -1,7 +1,9 @@
 #include "thread.h"
 #include "aarch64.h"
+#include "assert.h"
 #include "board.h"
 #include "mm.h"
+#include "slab.h"
 #include "util.h"
 
 extern thread_t _Thread_local current_thread;
@@ -15,13 +17,34 @@ extern uint64_t tbss_align;
 #define _tbss_size (((uint64_t)&tbss_size) - RAM_START)
 #define _tbss_align (((uint64_t)&tbss_align) - RAM_START)
 
+/**
+ * @brief cache of thread tls blocks, cache line aligned so threads running on
+ * different cpus never share a line
+ */
+static kmem_cache_t *thread_cache = NULL;
+
+/**
+ * @brief create cache for threads
+ * should be called after boot_mem_init and before first create_thread
+ */
+void thread_cache_init(void) {
+  uint64_t align = _tbss_align;
+  if (align < CACHE_LINE_SIZE) {
+    align = CACHE_LINE_SIZE;
+  }
+  thread_cache = kmem_cache_create("thread", _tbss_size, align, 0U, NULL);
+  if (thread_cache == NULL) {
+    fatal("thread cache creation failed\n");
+  }
+}
+
 /**
  * @brief create thread
  *
  */
 thread_t *create_thread(void) {
   /*allocate memory for thread*/
-  thread_t *thread = (thread_t *)kmalloc_aligned(_tbss_size, _tbss_align);
+  thread_t *thread = (thread_t *)kmem_cache_alloc_obj(thread_cache);
   /*clean the memory*/
   memset((void *)thread, 0x0, _tbss_size);
   return thread;
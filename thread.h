@@ -93,6 +93,12 @@ typedef struct thread {
  */
 extern void setup_thread(thread_t *thread);
 
+/**
+ * @brief create cache for threads
+ * should be called after boot_mem_init and before first create_thread
+ */
+void thread_cache_init(void);
+
 /**
  * @brief create thread
  *
@@ -115,6 +115,10 @@ uint64_t raw_read_cntv_cval_el0(void) {
  * @return timestamp in ns
  */
 uint64_t get_system_timestamp_ns(void) {
+  /*can be called before platform_timer_init (ex: to time early boot)*/
+  if (cntfrq == 0U) {
+    cntfrq = raw_read_cntfrq_el0();
+  }
   return (((get_current_ticks() * (1000000000ULL)) / cntfrq));
 }
 
@@ -68,5 +68,9 @@ void memcpy(void *dst, void *src, unsigned int size);
 void memmove(void *dst, void *src, unsigned int size);
 int memcmp(void *src1, void *src2, unsigned int size);
 uint64_t strlen(const char *string);
+/*zero a PAGE_SIZE aligned page, uses dc zva once mmu is on*/
+void clear_page(void *page);
+/*copy a PAGE_SIZE aligned page, 64 bytes per iteration*/
+void copy_page(void *dst, void *src);
 
 #endif
\ No newline at end of file